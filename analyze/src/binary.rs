@@ -0,0 +1,283 @@
+//! This module reads Baresifter output that contains binary records
+//! (`output=binary`) as well as text.
+//!
+//! Binary records come in blocks that start with a zero byte, which
+//! never appears in text output:
+//!
+//! ```text
+//! 00 N record... A B
+//! ```
+//!
+//! N is the number of records. Each record is a byte with the
+//! exception in the upper and the length in the lower four bits,
+//! followed by the instruction bytes. An exception of F means that the
+//! exception follows in a byte of its own. A length of F marks an
+//! instruction whose length is unknown (`??` in text). A and B are the
+//! Fletcher-16 checksum of N and the records.
+
+use std::{
+    collections::VecDeque,
+    io::{self, BufRead, ErrorKind},
+    str::FromStr,
+};
+
+use crate::instruction::{Instruction, InstructionRange};
+
+/// The length that marks an instruction of unknown length.
+const UNKNOWN_LENGTH: u8 = 0xF;
+
+/// The exception that means the exception follows in its own byte.
+const ESCAPED_EXCEPTION: u8 = 0xF;
+
+/// A record of a binary block.
+#[derive(Debug, Clone, PartialEq)]
+pub struct Record {
+    pub exception: u8,
+    pub length_known: bool,
+    pub bytes: Vec<u8>,
+}
+
+impl Record {
+    /// Convert the record to an instruction. Like the text parser,
+    /// this only takes instructions with a known length.
+    pub fn instruction(&self) -> Option<Instruction> {
+        if self.length_known {
+            Instruction::new(self.exception, &self.bytes).ok()
+        } else {
+            None
+        }
+    }
+}
+
+fn read_byte<R: BufRead>(reader: &mut R, sum: &mut Fletcher16) -> io::Result<u8> {
+    let mut byte = [0u8; 1];
+
+    reader.read_exact(&mut byte)?;
+    sum.add(byte[0]);
+
+    Ok(byte[0])
+}
+
+#[derive(Default)]
+struct Fletcher16 {
+    sum1: u32,
+    sum2: u32,
+}
+
+impl Fletcher16 {
+    fn add(&mut self, byte: u8) {
+        self.sum1 = (self.sum1 + u32::from(byte)) % 255;
+        self.sum2 = (self.sum2 + self.sum1) % 255;
+    }
+}
+
+/// Read the rest of a block after its leading zero byte.
+pub fn read_block<R: BufRead>(reader: &mut R) -> io::Result<Vec<Record>> {
+    let mut sum = Fletcher16::default();
+    let count = read_byte(reader, &mut sum)?;
+    let mut records = Vec::with_capacity(count.into());
+
+    for _ in 0..count {
+        let exc_len = read_byte(reader, &mut sum)?;
+        let exception = match exc_len >> 4 {
+            ESCAPED_EXCEPTION => read_byte(reader, &mut sum)?,
+            exception => exception,
+        };
+        let length = exc_len & 0xF;
+        let mut bytes = vec![0u8; length.into()];
+
+        for b in bytes.iter_mut() {
+            *b = read_byte(reader, &mut sum)?;
+        }
+
+        records.push(Record {
+            exception,
+            length_known: length != UNKNOWN_LENGTH,
+            bytes,
+        });
+    }
+
+    let mut checksum = [0u8; 2];
+    reader.read_exact(&mut checksum)?;
+
+    if u32::from(checksum[0]) != sum.sum1 || u32::from(checksum[1]) != sum.sum2 {
+        return Err(io::Error::new(
+            ErrorKind::InvalidData,
+            "checksum mismatch in binary block",
+        ));
+    }
+
+    Ok(records)
+}
+
+/// An iterator over the instructions in Baresifter output, no matter
+/// whether they were printed as text, ranges or binary records.
+pub struct OutputReader<R: BufRead> {
+    reader: R,
+    pending: VecDeque<Instruction>,
+}
+
+impl<R: BufRead> OutputReader<R> {
+    pub fn new(reader: R) -> Self {
+        Self {
+            reader,
+            pending: VecDeque::new(),
+        }
+    }
+
+    /// Read the next line or block. Returns false at the end of the
+    /// input.
+    fn refill(&mut self) -> bool {
+        let first = match self.reader.fill_buf() {
+            Ok([]) | Err(_) => return false,
+            Ok(buf) => buf[0],
+        };
+
+        if first == 0 {
+            self.reader.consume(1);
+
+            match read_block(&mut self.reader) {
+                Ok(records) => self
+                    .pending
+                    .extend(records.iter().filter_map(Record::instruction)),
+                // Skip broken blocks. Text output or the next block
+                // gets us back in sync.
+                Err(e) => eprintln!("Skipping binary block: {}", e),
+            }
+        } else {
+            let mut line = Vec::new();
+
+            if self.reader.read_until(b'\n', &mut line).is_err() {
+                return false;
+            }
+
+            if let Ok(range) = InstructionRange::from_str(String::from_utf8_lossy(&line).trim_end()) {
+                self.pending.extend(range.iter());
+            }
+        }
+
+        true
+    }
+}
+
+impl<R: BufRead> Iterator for OutputReader<R> {
+    type Item = Instruction;
+
+    fn next(&mut self) -> Option<Instruction> {
+        while self.pending.is_empty() {
+            if !self.refill() {
+                return None;
+            }
+        }
+
+        self.pending.pop_front()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// Build a block like the kernel does.
+    fn block(records: &[(u8, u8, &[u8])]) -> Vec<u8> {
+        assert!(records.len() <= 255, "too many records for one block");
+
+        let mut data = vec![0, records.len() as u8];
+
+        for (exception, length, bytes) in records {
+            if *exception >= ESCAPED_EXCEPTION {
+                data.push(ESCAPED_EXCEPTION << 4 | length);
+                data.push(*exception);
+            } else {
+                data.push(exception << 4 | length);
+            }
+            data.extend_from_slice(bytes);
+        }
+
+        let mut sum = Fletcher16::default();
+        data[1..].iter().for_each(|b| sum.add(*b));
+        data.push(sum.sum1 as u8);
+        data.push(sum.sum2 as u8);
+
+        data
+    }
+
+    #[test]
+    fn reads_records() -> io::Result<()> {
+        let data = block(&[
+            (0x6, 2, &[0x0f, 0x0b]),
+            (0x11, 3, &[0x0f, 0x0a, 0x00]),
+            (0xd, UNKNOWN_LENGTH, &[0x66; 15]),
+        ]);
+        let records = read_block(&mut &data[1..])?;
+
+        assert_eq!(records.len(), 3);
+        assert_eq!(records[0].exception, 0x6);
+        assert_eq!(records[0].bytes, [0x0f, 0x0b]);
+        assert_eq!(records[1].exception, 0x11);
+        assert_eq!(records[1].bytes, [0x0f, 0x0a, 0x00]);
+        assert!(!records[2].length_known);
+        assert_eq!(records[2].bytes.len(), 15);
+
+        Ok(())
+    }
+
+    #[test]
+    fn reads_full_blocks_of_short_records() -> io::Result<()> {
+        // 1 and 2 byte instructions take 2 and 3 bytes per record. So the
+        // kernel fills a block with 255 records long before it runs out of
+        // room and has to start the next one.
+        let bytes: Vec<[u8; 2]> = (0..600u32).map(|i| [i as u8, (i >> 8) as u8]).collect();
+        let records: Vec<(u8, u8, &[u8])> = bytes
+            .iter()
+            .enumerate()
+            .map(|(i, b)| (6, 1 + (i % 2) as u8, &b[..1 + i % 2]))
+            .collect();
+
+        let mut data = Vec::new();
+        for chunk in records.chunks(255) {
+            data.extend(block(chunk));
+        }
+
+        assert_eq!(read_block(&mut &data[1..])?.len(), 255);
+
+        let instrs: Vec<Instruction> = OutputReader::new(&data[..]).collect();
+        let expected: Vec<Instruction> = records
+            .iter()
+            .map(|(exception, _, bytes)| Instruction::new(*exception, bytes).unwrap())
+            .collect();
+
+        assert_eq!(instrs, expected);
+
+        Ok(())
+    }
+
+    #[test]
+    fn rejects_bad_checksum() {
+        let mut data = block(&[(0x6, 2, &[0x0f, 0x0b])]);
+        data[3] ^= 1;
+
+        assert!(read_block(&mut &data[1..]).is_err());
+    }
+
+    #[test]
+    fn mixes_text_and_blocks() {
+        let mut data = b">>> Probing instruction space.\n".to_vec();
+        data.extend(block(&[(0xe, 2, &[0x00, 0x00]), (0x6, 2, &[0x0f, 0x0b])]));
+        data.extend(b"EXC 0D OK | 0F [05-06]\n");
+        data.extend(block(&[(0x6, 1, &[0x0a])]));
+
+        let instrs: Vec<Instruction> = OutputReader::new(&data[..]).collect();
+
+        assert_eq!(
+            instrs,
+            vec![
+                Instruction::new(0xe, &[0x00, 0x00]).unwrap(),
+                Instruction::new(0x6, &[0x0f, 0x0b]).unwrap(),
+                Instruction::new(0xd, &[0x0f, 0x05]).unwrap(),
+                Instruction::new(0xd, &[0x0f, 0x06]).unwrap(),
+                Instruction::new(0x6, &[0x0a]).unwrap(),
+            ]
+        );
+    }
+}
@@ -1,6 +1,11 @@
 //! This module contains the types to represent baresifter output.
 
-use std::{convert::TryInto, error::Error, fmt, iter::Peekable};
+use std::{
+    convert::TryInto,
+    error::Error,
+    fmt,
+    iter::{self, Peekable},
+};
 
 /// A representation of a single instruction as it is outut by
 /// Barsifter.
@@ -114,6 +119,53 @@ impl Instruction {
     }
 }
 
+/// Instructions that only differ in their last byte, as Baresifter
+/// prints them with `output=ranges`:
+///
+/// ```text
+/// EXC 06 OK | 0F 0D [C0-FF]
+/// ```
+///
+/// All of them have the same exception and length.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct InstructionRange {
+    first: Instruction,
+    last: Instruction,
+}
+
+impl InstructionRange {
+    /// Create a range from its first instruction and the last byte of
+    /// its last instruction.
+    pub fn new(first: Instruction, last_byte: u8) -> Result<Self, InvalidInstruction> {
+        let pos = first.len().checked_sub(1).ok_or_else(InvalidInstruction::default)?;
+
+        if last_byte < first.bytes[pos] {
+            return Err(InvalidInstruction::default());
+        }
+
+        let mut last = first;
+        last.bytes[pos] = last_byte;
+
+        Ok(InstructionRange { first, last })
+    }
+
+    /// Return all instructions in the range.
+    pub fn iter(&self) -> impl Iterator<Item = Instruction> {
+        // The range is the same walk that we interpolate between two
+        // lines of output, including its end.
+        InterpolateOneIterator::new(self.first, self.last).chain(iter::once(self.last))
+    }
+}
+
+impl From<Instruction> for InstructionRange {
+    fn from(instr: Instruction) -> Self {
+        InstructionRange {
+            first: instr,
+            last: instr,
+        }
+    }
+}
+
 /// An iterator that interpolates missing lines from Baresifter output.
 #[derive(Debug)]
 struct InterpolateOneIterator {
@@ -304,6 +356,31 @@ mod tests {
         Ok(())
     }
 
+    #[test]
+    fn instruction_range_works() -> Result<(), InvalidInstruction> {
+        let first = Instruction::new(0x6, &[0x0f, 0x0d, 0xfd])?;
+        let range: Vec<Instruction> = InstructionRange::new(first, 0xff)?.iter().collect();
+
+        assert_eq!(
+            range,
+            vec![
+                first,
+                Instruction::new(0x6, &[0x0f, 0x0d, 0xfe])?,
+                Instruction::new(0x6, &[0x0f, 0x0d, 0xff])?,
+            ]
+        );
+
+        let single: Vec<Instruction> = InstructionRange::from(first).iter().collect();
+        assert_eq!(single, vec![first]);
+
+        assert_eq!(
+            InstructionRange::new(first, 0xfc),
+            Err(InvalidInstruction::default())
+        );
+
+        Ok(())
+    }
+
     fn interpolate_instructions(instrs: &[Instruction]) -> Vec<Instruction> {
         InterpolateAllIterator::new(instrs.iter().copied()).collect()
     }
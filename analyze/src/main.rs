@@ -1,16 +1,13 @@
 use anyhow::{anyhow, Context, Result};
 use clap::{crate_version, Clap};
-use std::{
-    fs::File,
-    io::{BufRead, BufReader},
-    path::PathBuf,
-    str::FromStr,
-};
+use std::{fs::File, io::BufReader, path::PathBuf};
 
+mod binary;
 mod instruction;
 mod parser;
 mod utils;
 
+use binary::OutputReader;
 use instruction::{Instruction, InterpolateAllIterator};
 use utils::slice_as_hex_string;
 
@@ -21,7 +18,8 @@ struct Opts {
     #[clap(long, default_value = "64")]
     bits: u8,
 
-    /// The input file to parse.
+    /// The input file to parse. It can contain text output, ranges
+    /// (output=ranges) and binary records (output=binary).
     input_file: PathBuf,
 }
 
@@ -45,10 +43,7 @@ fn main() -> Result<()> {
         .with_context(|| format!("Failed to open input file: {}", opts.input_file.display()))?;
     let file = BufReader::new(file);
 
-    let instrs = InterpolateAllIterator::new(
-        file.lines()
-            .filter_map(|l| -> Option<Instruction> { Instruction::from_str(&l.ok()?).ok() }),
-    )
+    let instrs = InterpolateAllIterator::new(OutputReader::new(file))
     .map(|i| {
         let iced_instr = decoder(&i);
         (i, iced_instr)
@@ -1,14 +1,17 @@
 //! This module implements a parser for Baresifter output.
 
 use nom::{
+    branch::alt,
     bytes::complete::{tag, take_while_m_n},
-    combinator::map_res,
-    multi::separated_list1,
-    Finish, IResult,
+    combinator::{map, map_res},
+    error::{Error as ParseError, ErrorKind},
+    multi::{many0, separated_list1},
+    sequence::{delimited, separated_pair, terminated},
+    Err as ParseErr, Finish, IResult,
 };
 use std::str::FromStr;
 
-use crate::instruction::{Instruction, InvalidInstruction};
+use crate::instruction::{Instruction, InstructionRange, InvalidInstruction};
 
 fn from_hex(input: &str) -> Result<u8, std::num::ParseIntError> {
     u8::from_str_radix(input, 16)
@@ -36,6 +39,41 @@ fn instruction(input: &str) -> IResult<&str, Instruction> {
     ))
 }
 
+/// Parse the last byte of a line, which is either a byte or a range
+/// of bytes like `[C0-FF]`.
+fn last_byte(input: &str) -> IResult<&str, (u8, u8)> {
+    alt((
+        delimited(tag("["), separated_pair(hex_byte, tag("-"), hex_byte), tag("]")),
+        map(hex_byte, |b| (b, b)),
+    ))(input)
+}
+
+fn instruction_range(input: &str) -> IResult<&str, InstructionRange> {
+    let (input, _) = tag("EXC ")(input)?;
+    let (input, exc) = hex_byte(input)?;
+    let (input, _) = tag(" OK | ")(input)?;
+    let (input, mut bytes) = many0(terminated(hex_byte, tag(" ")))(input)?;
+    let (rest, (first, last)) = last_byte(input)?;
+
+    bytes.push(first);
+
+    Instruction::new(exc, &bytes)
+        .and_then(|first| InstructionRange::new(first, last))
+        .map(|range| (rest, range))
+        .map_err(|_| ParseErr::Error(ParseError::new(input, ErrorKind::Verify)))
+}
+
+impl FromStr for InstructionRange {
+    type Err = InvalidInstruction;
+
+    fn from_str(s: &str) -> std::result::Result<Self, InvalidInstruction> {
+        Ok(instruction_range(s)
+            .finish()
+            .map_err(|_| InvalidInstruction::default())?
+            .1)
+    }
+}
+
 impl FromStr for Instruction {
     type Err = InvalidInstruction;
 
@@ -61,4 +99,32 @@ mod tests {
 
         Ok(())
     }
+
+    #[test]
+    fn test_parse_range() -> Result<()> {
+        let instrs: Vec<Instruction> = instruction_range("EXC 06 OK | 0F 0D [FD-FF]")?
+            .1
+            .iter()
+            .collect();
+
+        assert_eq!(
+            instrs,
+            vec![
+                Instruction::new(0x6, &[0x0f, 0x0d, 0xfd])?,
+                Instruction::new(0x6, &[0x0f, 0x0d, 0xfe])?,
+                Instruction::new(0x6, &[0x0f, 0x0d, 0xff])?,
+            ]
+        );
+
+        let single = instruction_range("EXC 0D OK | 00 04 2E")?.1;
+        assert_eq!(
+            single,
+            InstructionRange::from(Instruction::new(0xd, &[0x00, 0x04, 0x2e])?)
+        );
+
+        assert!(InstructionRange::from_str("EXC 06 OK | [91-90]").is_err());
+        assert!(InstructionRange::from_str("EXC 0D ?? | 66 66").is_err());
+
+        Ok(())
+    }
 }
@@ -15,7 +15,27 @@ let
     patchShebangs $out/bin/baresifter-run
 
     wrapProgram $out/bin/baresifter-run \
-      --prefix PATH : ${pkgs.lib.makeBinPath (with pkgs; [ qemu file binutils-unwrapped ])}
+      --prefix PATH : ${pkgs.lib.makeBinPath (with pkgs; [ qemu file binutils-unwrapped baresifter-decompress ])}
+  '';
+
+  baresifter-decompress = pkgs.runCommandNoCC "baresifter-decompress"
+    {
+      buildInputs = [ pkgs.python3 ];
+    } ''
+    mkdir -p $out/bin
+
+    install -m 0755 ${../tools/baresifter-decompress} $out/bin/baresifter-decompress
+    patchShebangs $out/bin/baresifter-decompress
+  '';
+
+  baresifter-queue = pkgs.runCommandNoCC "baresifter-queue"
+    {
+      buildInputs = [ pkgs.python3 ];
+    } ''
+    mkdir -p $out/bin
+
+    install -m 0755 ${../tools/baresifter-queue} $out/bin/baresifter-queue
+    patchShebangs $out/bin/baresifter-queue
   '';
 
   naersk = pkgs.callPackage sources.naersk {};
@@ -36,7 +56,7 @@ let
   '';
 in
 {
-  inherit baresifter baresifter-run analyze;
+  inherit baresifter baresifter-run baresifter-queue baresifter-decompress analyze;
 
   test-x86_64-tcg = testcase { mode = "tcg"; binary = "baresifter.x86_64.elf"; };
   test-x86_32-tcg = testcase { mode = "tcg"; binary = "baresifter.x86_32.elf"; };
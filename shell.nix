@@ -15,5 +15,7 @@ pkgs.mkShell {
 
     # Running tests
     local.baresifter-run
+    local.baresifter-queue
+    local.baresifter-decompress
   ];
 }
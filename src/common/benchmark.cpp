@@ -0,0 +1,109 @@
+#include "arch.hpp"
+#include "benchmark.hpp"
+#include "probe.hpp"
+#include "search.hpp"
+#include "timer.hpp"
+#include "util.hpp"
+#include "x86.hpp"
+
+static void print_result(const char *what, uint64_t cycles, size_t iterations,
+                         uint64_t tsc_frequency)
+{
+  format(">>> Benchmark: ", cycles / iterations, " cycles per ", what, ", ",
+         iterations * tsc_frequency / (cycles ? cycles : 1), " ", what, "s per second.\n");
+}
+
+// Place a NOP right before the end of the given user page and return its user
+// space address. Executing it results in a single-step trap.
+static uintptr_t place_nop(size_t page)
+{
+  get_user_page_backing(page)[page_size - 1] = 0x90;
+  return get_user_page(page) + page_size - 1;
+}
+
+// Compare execute_user() with execute_user_batch().
+static void benchmark_user_entry(size_t iterations, uint64_t tsc_frequency)
+{
+  uintptr_t ips[user_page_count];
+  user_exception results[user_page_count];
+
+  for (size_t i = 0; i < array_size(ips); i++)
+    ips[i] = place_nop(i);
+
+  uint64_t start = rdtsc();
+  for (size_t i = 0; i < iterations; i++)
+    execute_user(ips[i % array_size(ips)]);
+  print_result("execution", rdtsc() - start, iterations, tsc_frequency);
+
+  start = rdtsc();
+  for (size_t done = 0; done < iterations; done += array_size(ips)) {
+    size_t const left = iterations - done;
+    execute_user_batch(ips, results, left < array_size(ips) ? left : array_size(ips));
+  }
+  print_result("batched execution", rdtsc() - start, iterations, tsc_frequency);
+}
+
+// Find the length of the first candidates of an unprefixed search, like the
+// main loop does.
+static void benchmark_attempts(cpu_features const &features, probe_mode mode,
+                               size_t iterations, uint64_t tsc_frequency)
+{
+  search_engine search;
+  execution_attempt last_attempt;
+  size_t done = 0;
+
+  uint64_t const start = rdtsc();
+  do {
+    auto const attempt = find_instruction_length(features, mode, search.get_candidate());
+
+    search.clear_after(attempt.length);
+    if (attempt != last_attempt)
+      search.start_over(attempt.length);
+
+    last_attempt = attempt;
+  } while (++done < iterations and search.find_next_candidate());
+  print_result("attempt", rdtsc() - start, done, tsc_frequency);
+}
+
+// Enumerate candidates without executing them. Every candidate is treated as
+// an interesting one-byte instruction after its prefixes, so the search walks
+// all prefix combinations and their opcode bytes.
+template <int PREFIXES>
+static void benchmark_candidates(size_t max_prefixes, size_t iterations, uint64_t tsc_frequency)
+{
+  basic_search_engine<PREFIXES> search { max_prefixes };
+  size_t done = 0;
+
+  uint64_t const start = rdtsc();
+  do {
+    size_t const length = search.prefix_length() + 1;
+
+    search.clear_after(length);
+    search.start_over(length);
+  } while (++done < iterations and search.find_next_candidate());
+  format(">>> Benchmark: ", done, " candidates with up to ", max_prefixes, " prefixes",
+         PREFIXES == configured_prefixes ? "" : " (specialized)", ".\n");
+  print_result("candidate", rdtsc() - start, done, tsc_frequency);
+}
+
+void run_benchmarks(cpu_features const &features, probe_mode mode, size_t iterations)
+{
+  uint64_t const tsc_frequency = get_tsc_frequency();
+  format(">>> Benchmark: TSC runs at ", tsc_frequency / 1000000, " MHz.\n");
+
+  // The user entry benchmark executes on every user page. The probe mode gets
+  // the pages that it searches with, so the numbers of all modes compare.
+  map_user_pages();
+  benchmark_user_entry(iterations, tsc_frequency);
+  if (not needs_user_pages(mode))
+    unmap_user_pages();
+
+  benchmark_attempts(features, mode, iterations, tsc_frequency);
+
+  for (size_t max_prefixes = 0; max_prefixes <= 4; max_prefixes++)
+    benchmark_candidates<configured_prefixes>(max_prefixes, iterations, tsc_frequency);
+
+  benchmark_candidates<0>(0, iterations, tsc_frequency);
+  benchmark_candidates<1>(1, iterations, tsc_frequency);
+  benchmark_candidates<2>(2, iterations, tsc_frequency);
+}
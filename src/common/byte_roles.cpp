@@ -0,0 +1,232 @@
+#include <cstring>
+
+#include "arch.hpp"
+#include "byte_roles.hpp"
+#include "util.hpp"
+
+static cache_line_aligned<byte_role_statistics> cpu_stats[max_cpus];
+
+byte_role_statistics const &get_byte_role_statistics()
+{
+  static byte_role_statistics total;
+
+  total = {};
+  for (auto const &c : cpu_stats) {
+    auto const &s = c.value;
+    total.redundant_candidates += s.redundant_candidates;
+    total.payload_subtrees += s.payload_subtrees;
+  }
+
+  return total;
+}
+
+// The ModRM and SIB values that we check before we assume that a byte has
+// addressing classes. The ModRM values have every reg in every class of mod
+// and rm, one row per class, so group opcodes show all of their instructions.
+// Where rm only selects a register, it is not the smallest of its class.
+static const uint8_t modrm_samples[] {
+  0x01, 0x0A, 0x13, 0x1E, 0x27, 0x29, 0x32, 0x3B,
+  0x04, 0x0C, 0x14, 0x1C, 0x24, 0x2C, 0x34, 0x3C,
+  0x05, 0x0D, 0x15, 0x1D, 0x25, 0x2D, 0x35, 0x3D,
+  0x41, 0x4A, 0x53, 0x5D, 0x66, 0x6F, 0x71, 0x7A,
+  0x44, 0x4C, 0x54, 0x5C, 0x64, 0x6C, 0x74, 0x7C,
+  0x81, 0x8A, 0x93, 0x9D, 0xA6, 0xAF, 0xB1, 0xBA,
+  0x84, 0x8C, 0x94, 0x9C, 0xA4, 0xAC, 0xB4, 0xBC,
+  0xC1, 0xCA, 0xD3, 0xDC, 0xE5, 0xEE, 0xF7, 0xF9,
+};
+
+static const uint8_t sib_samples[] {
+  0x01, 0x0D, 0x24, 0x3A, 0x45, 0x63, 0x8E, 0xB5, 0xC4, 0xFF,
+};
+
+// The values that we check before we assume that a byte is a payload byte.
+// They have every value of the bits that make a difference for ModRM and SIB
+// bytes, so those are caught early. find_role() adds a few random ones.
+static const uint8_t payload_samples[] {
+  0x04, 0x05, 0xC0, 0x80, 0x40, 0x01, 0x02, 0x03, 0x06, 0x07, 0xFF,
+};
+
+// Return the smallest value that is in the same class as the given one.
+static uint8_t representative(byte_role role, uint8_t value)
+{
+  uint8_t const mod = value >> 6;
+  uint8_t const reg = (value >> 3) & 7;
+  uint8_t const rm = value & 7;
+
+  switch (role) {
+  case byte_role::modrm:
+  case byte_role::modrm_with_reg: {
+    // With a memory operand, rm=4 adds a SIB byte and mod=0, rm=5 replaces the
+    // base register with a 32-bit displacement. The other values of rm only
+    // select a register.
+    uint8_t const rm_class = (mod != 3 and (rm == 4 or (mod == 0 and rm == 5))) ? rm : 0;
+
+    return (mod << 6) | (role == byte_role::modrm_with_reg ? reg << 3 : 0) | rm_class;
+  }
+  case byte_role::sib:
+    // base=5 replaces the base register with a displacement for mod=0.
+    return rm == 5 ? 5 : 0;
+  case byte_role::payload:
+    return 0;
+  case byte_role::other:
+    break;
+  }
+
+  return value;
+}
+
+static bool is_modrm(byte_role role)
+{
+  return role == byte_role::modrm or role == byte_role::modrm_with_reg;
+}
+
+byte_roles::known_role const *byte_roles::lookup(instruction_bytes const &instr, size_t pos) const
+{
+  auto const &known = roles_[pos];
+
+  if (not known.valid)
+    return nullptr;
+
+  for (size_t i = 0; i < pos; i++) {
+    if (known.instr.raw[i] != instr.raw[i])
+      return nullptr;
+  }
+
+  return &known;
+}
+
+execution_attempt byte_roles::probe(instruction_bytes const &instr, size_t pos, uint8_t value)
+{
+  if (not probed_[value]) {
+    instruction_bytes probed {};
+
+    memcpy(probed.raw, instr.raw, pos);
+    probed.raw[pos] = value;
+
+    attempts_[value] = find_instruction_length(features_, mode_, probed);
+    probed_[value] = true;
+  }
+
+  return attempts_[value];
+}
+
+bool byte_roles::has_classes(instruction_bytes const &instr, size_t pos, byte_role role,
+                             uint8_t const *samples, size_t sample_count)
+{
+  for (size_t i = 0; i < sample_count; i++) {
+    uint8_t const rep = representative(role, samples[i]);
+
+    if (rep != samples[i] and probe(instr, pos, samples[i]) != probe(instr, pos, rep))
+      return false;
+  }
+
+  return true;
+}
+
+bool byte_roles::is_modrm_at(instruction_bytes const &instr, size_t pos)
+{
+  // A ModRM byte with mod=0 needs a SIB byte for rm=4 and a 32-bit
+  // displacement for rm=5. mod=3 needs nothing. This doesn't hold for 16-bit
+  // addressing, which we leave alone.
+  auto const plain = probe(instr, pos, 0x00);
+
+  return plain.length > pos and plain.length + 4u <= sizeof(instr.raw) and
+    probe(instr, pos, 0xC0).length == plain.length and
+    probe(instr, pos, 0x04).length == plain.length + 1 and
+    probe(instr, pos, 0x05).length == plain.length + 4;
+}
+
+bool byte_roles::is_payload_at(instruction_bytes const &instr, size_t pos)
+{
+  auto const plain = probe(instr, pos, 0x00);
+
+  if (plain.length <= pos)
+    return false;
+
+  for (auto value : payload_samples) {
+    if (probe(instr, pos, value) != plain)
+      return false;
+  }
+
+  for (size_t i = 0; i < 4; i++) {
+    // xorshift32
+    random_ ^= random_ << 13;
+    random_ ^= random_ >> 17;
+    random_ ^= random_ << 5;
+
+    if (probe(instr, pos, (uint8_t)random_) != plain)
+      return false;
+  }
+
+  return true;
+}
+
+byte_role byte_roles::find_role(instruction_bytes const &instr, size_t pos)
+{
+  // ModRM, SIB and payload bytes need an opcode in front of them.
+  if (pos == 0)
+    return byte_role::other;
+
+  memset(probed_, 0, sizeof(probed_));
+
+  // The byte after a ModRM byte is a SIB byte, a displacement or an immediate.
+  // The byte after those is never a ModRM byte.
+  bool could_be_modrm = find_classes_;
+
+  if (auto const *before = lookup(instr, pos - 1)) {
+    uint8_t const modrm = instr.raw[pos - 1];
+
+    if (find_classes_ and is_modrm(before->role) and (modrm >> 6) != 3 and (modrm & 7) == 4 and
+        has_classes(instr, pos, byte_role::sib, sib_samples, array_size(sib_samples)))
+      return byte_role::sib;
+
+    if (before->role != byte_role::other)
+      could_be_modrm = false;
+  }
+
+  if (could_be_modrm and is_modrm_at(instr, pos)) {
+    if (has_classes(instr, pos, byte_role::modrm, modrm_samples, array_size(modrm_samples)))
+      return byte_role::modrm;
+
+    if (has_classes(instr, pos, byte_role::modrm_with_reg, modrm_samples, array_size(modrm_samples)))
+      return byte_role::modrm_with_reg;
+  }
+
+  if (find_payload_ and is_payload_at(instr, pos))
+    return byte_role::payload;
+
+  return byte_role::other;
+}
+
+byte_role byte_roles::role_of(instruction_bytes const &candidate, size_t pos)
+{
+  if (pos >= array_size(roles_))
+    return byte_role::other;
+
+  if (auto const *known = lookup(candidate, pos))
+    return known->role;
+
+  auto &slot = roles_[pos];
+
+  slot.role = find_role(candidate, pos);
+  slot.instr = candidate;
+  slot.valid = true;
+
+  return slot.role;
+}
+
+bool byte_roles::is_redundant(instruction_bytes const &candidate, size_t pos)
+{
+  auto const role = role_of(candidate, pos);
+  uint8_t const value = candidate.raw[pos];
+
+  if (representative(role, value) == value)
+    return false;
+
+  if (role == byte_role::payload)
+    cpu_stats[cpu_index()].value.payload_subtrees++;
+  else
+    cpu_stats[cpu_index()].value.redundant_candidates++;
+
+  return true;
+}
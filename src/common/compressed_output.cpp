@@ -0,0 +1,136 @@
+#include <cstdint>
+#include <cstring>
+
+#include "compressed_output.hpp"
+#include "util.hpp"
+
+namespace {
+
+// Matches are at least this long. Shorter ones cost more than the literals.
+const size_t min_match = 4;
+
+const size_t match_table_bits = 12;
+
+// The start, length and checksum of a frame around the worst case of data that
+// doesn't compress at all.
+const size_t max_frame_size = 3 + max_frame_data + max_frame_data / 255 + 16 + 2;
+
+}
+
+// The last position plus one of each hash of four bytes. Zero means none.
+static uint16_t match_table[1 << match_table_bits];
+
+static uint8_t frame[max_frame_size];
+
+static uint32_t read32(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static size_t match_hash(uint32_t v)
+{
+  return (v * 2654435761U) >> (32 - match_table_bits);
+}
+
+// Remember the position of the four bytes there.
+static size_t remember(const uint8_t *data, size_t pos)
+{
+  size_t const hash = match_hash(read32(data + pos));
+  size_t const last = match_table[hash];
+
+  match_table[hash] = pos + 1;
+  return last;
+}
+
+// Put the rest of a length that didn't fit into its nibble.
+static uint8_t *put_length(uint8_t *out, size_t length)
+{
+  for (; length >= 255; length -= 255)
+    *(out++) = 255;
+
+  *(out++) = length;
+  return out;
+}
+
+// Put a sequence of literals followed by a match. A match_length of zero means
+// there is no match.
+static uint8_t *put_sequence(uint8_t *out, const uint8_t *literals, size_t literal_length,
+                             size_t offset, size_t match_length)
+{
+  size_t const extra_match = match_length ? match_length - min_match : 0;
+
+  *(out++) = (literal_length < 15 ? literal_length : 15) << 4 | (extra_match < 15 ? extra_match : 15);
+
+  if (literal_length >= 15)
+    out = put_length(out, literal_length - 15);
+
+  memcpy(out, literals, literal_length);
+  out += literal_length;
+
+  if (match_length) {
+    *(out++) = offset;
+    *(out++) = offset >> 8;
+
+    if (extra_match >= 15)
+      out = put_length(out, extra_match - 15);
+  }
+
+  return out;
+}
+
+const char *compress_frame(const char *chars, size_t length, size_t &frame_length)
+{
+  assert(length <= max_frame_data, "Too much data for a frame");
+
+  auto const data = reinterpret_cast<const uint8_t *>(chars);
+  uint8_t *out = frame + 3;
+  size_t literals = 0;
+
+  memset(match_table, 0, sizeof(match_table));
+
+  for (size_t pos = 0; pos + min_match <= length;) {
+    size_t const last = remember(data, pos);
+
+    if (last == 0 or read32(data + last - 1) != read32(data + pos)) {
+      pos++;
+      continue;
+    }
+
+    size_t const match = last - 1;
+    size_t match_length = min_match;
+
+    while (pos + match_length < length and data[match + match_length] == data[pos + match_length])
+      match_length++;
+
+    out = put_sequence(out, data + literals, pos - literals, pos - match, match_length);
+
+    // Matches are mostly in the line before, so remember where this one is.
+    for (size_t i = pos + 1; i < pos + match_length and i + min_match <= length; i++)
+      remember(data, i);
+
+    pos += match_length;
+    literals = pos;
+  }
+
+  out = put_sequence(out, data + literals, length - literals, 0, 0);
+
+  uint32_t sum1 = 0, sum2 = 0;
+
+  for (size_t i = 0; i < length; i++) {
+    sum1 = (sum1 + data[i]) % 255;
+    sum2 = (sum2 + sum1) % 255;
+  }
+
+  size_t const compressed = out - (frame + 3);
+
+  frame[0] = 0x01;
+  frame[1] = compressed;
+  frame[2] = compressed >> 8;
+  *(out++) = sum1;
+  *(out++) = sum2;
+
+  frame_length = out - frame;
+  return reinterpret_cast<const char *>(frame);
+}
@@ -0,0 +1,95 @@
+#include "arch.hpp"
+#include "cpu_output.hpp"
+#include "util.hpp"
+#include "x86.hpp"
+
+namespace {
+
+// A ring buffer with a single application processor as producer and the boot
+// CPU as consumer. The positions only ever increase.
+struct output_buffer {
+  char data[8192];
+
+  // The end of the last complete line. Written by the application processor.
+  alignas(cache_line_size) size_t published = 0;
+
+  // The end of the buffered output. Only used by the application processor.
+  size_t head = 0;
+
+  // The end of the printed output. Written by the boot CPU. It has a cache
+  // line of its own, so the boot CPU doesn't take the producer's line away
+  // each time it has printed something.
+  alignas(cache_line_size) size_t tail = 0;
+};
+
+}
+
+static output_buffer output_buffers[max_cpus];
+
+static bool buffering = false;
+
+void start_output_buffering()
+{
+  buffering = true;
+}
+
+bool is_output_buffered()
+{
+  return buffering and cpu_index() != 0;
+}
+
+// Append a character without publishing it.
+static void append(output_buffer &buf, char c)
+{
+  while (buf.head - __atomic_load_n(&buf.tail, __ATOMIC_ACQUIRE) == sizeof(buf.data)) {
+    // Lines should never be this long, but don't wait forever if they are.
+    __atomic_store_n(&buf.published, buf.head, __ATOMIC_RELEASE);
+    pause();
+  }
+
+  buf.data[buf.head++ % sizeof(buf.data)] = c;
+}
+
+void buffer_output(const char *str)
+{
+  auto &buf = output_buffers[cpu_index()];
+
+  for (; *str; str++) {
+    append(buf, *str);
+
+    if (*str == '\n')
+      __atomic_store_n(&buf.published, buf.head, __ATOMIC_RELEASE);
+  }
+}
+
+void buffer_output(const char *data, size_t length)
+{
+  auto &buf = output_buffers[cpu_index()];
+
+  for (size_t i = 0; i < length; i++)
+    append(buf, data[i]);
+
+  __atomic_store_n(&buf.published, buf.head, __ATOMIC_RELEASE);
+}
+
+void drain_output_buffers()
+{
+  for (size_t cpu = 1; cpu < max_cpus; cpu++) {
+    auto &buf = output_buffers[cpu];
+    size_t const published = __atomic_load_n(&buf.published, __ATOMIC_ACQUIRE);
+    char chunk[128];
+
+    while (buf.tail != published) {
+      size_t len = 0;
+
+      while (buf.tail + len != published and len < sizeof(chunk)) {
+        chunk[len] = buf.data[(buf.tail + len) % sizeof(buf.data)];
+        len++;
+      }
+
+      write_output(chunk, len);
+
+      __atomic_store_n(&buf.tail, buf.tail + len, __ATOMIC_RELEASE);
+    }
+  }
+}
@@ -98,6 +98,12 @@ bool has_pse()
         and (get_cpuid(0x1).edx & (1 << 3));
 }
 
+bool has_apic()
+{
+    return get_cpuid_max_std_level() >= 1
+        and (get_cpuid(0x1).edx & (1 << 9));
+}
+
 bool has_wp()
 {
 #ifndef __x86_64__
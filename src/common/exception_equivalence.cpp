@@ -0,0 +1,75 @@
+#include "exception_equivalence.hpp"
+
+void exception_equivalence::leave_subtrees(instruction_bytes const &candidate)
+{
+  size_t common = 0;
+
+  while (common < sizeof(candidate.raw) and candidate.raw[common] == memory_.last_candidate.raw[common])
+    common++;
+
+  size_t kept = 0;
+
+  for (size_t i = 0; i < memory_.learned_count; i++) {
+    if (memory_.learned[i].at <= common)
+      memory_.learned[kept++] = memory_.learned[i];
+  }
+
+  memory_.learned_count = kept;
+  memory_.last_candidate = candidate;
+}
+
+bool exception_equivalence::is_learned(uint8_t a, uint8_t b) const
+{
+  for (size_t i = 0; i < memory_.learned_count; i++) {
+    auto const &l = memory_.learned[i];
+
+    if ((l.a == a and l.b == b) or (l.a == b and l.b == a))
+      return true;
+  }
+
+  return false;
+}
+
+void exception_equivalence::learn(uint8_t a, uint8_t b, size_t at)
+{
+  // When all slots are taken, we keep printing the flips of this pair.
+  if (memory_.learned_count < exception_memory::max_learned)
+    memory_.learned[memory_.learned_count++] = { a, b, static_cast<uint8_t>(at) };
+}
+
+bool exception_equivalence::is_interesting_change(execution_attempt const &last,
+                                                  execution_attempt const &now,
+                                                  instruction_bytes const &candidate, size_t pos)
+{
+  auto const before_last = memory_.before_last;
+
+  memory_.before_last = last;
+
+  if (last == now)
+    return false;
+
+  if (last.length != now.length or last.exception >= 32 or now.exception >= 32)
+    return true;
+
+  if (same_[last.exception] & (1u << now.exception))
+    return false;
+
+  if (not learn_)
+    return true;
+
+  // Learned pairs only apply in the subtree where we learned them.
+  leave_subtrees(candidate);
+
+  if (is_learned(last.exception, now.exception))
+    return false;
+
+  // We went from A to B and now back to A at the same length. We already
+  // printed both, so from now on this is just noise below the byte that
+  // brought us back.
+  if (before_last == now) {
+    learn(last.exception, now.exception, pos);
+    return false;
+  }
+
+  return true;
+}
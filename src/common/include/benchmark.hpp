@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstddef>
+
+#include "probe.hpp"
+
+struct cpu_features;
+
+// Measure how long the different ways of executing user space code take and
+// print the results. Each measurement does the given number of iterations.
+// Instruction lengths are found with the given probe mode.
+void run_benchmarks(cpu_features const &features, probe_mode mode, size_t iterations);
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "execution_attempt.hpp"
+#include "probe.hpp"
+#include "search.hpp"
+
+struct cpu_features;
+
+// What a byte of an instruction candidate does, as far as byte_roles can tell.
+enum class byte_role : uint8_t {
+  // We don't know. Every value has to be tried.
+  other,
+
+  // A ModRM byte. Values only differ in mod and in whether rm selects a SIB
+  // byte or a displacement instead of a base register.
+  modrm,
+
+  // Like modrm, but the reg field makes a difference as well. This is usually
+  // an opcode extension.
+  modrm_with_reg,
+
+  // A SIB byte. Values only differ in whether base selects a displacement
+  // instead of a base register.
+  sib,
+
+  // A byte of an immediate or a displacement. No value makes a difference.
+  payload,
+};
+
+// Finds out what the byte that the search increments does for the execution
+// attempt. Values of ModRM and SIB bytes fall into addressing classes that
+// result in the same execution attempt, so the search only needs to try the
+// smallest value of each class. Immediate and displacement bytes don't matter
+// at all, so the search can skip all of their values.
+//
+// A role is only assumed after probing a sample of values against the smallest
+// value that they are supposed to behave like.
+class byte_roles {
+  cpu_features const &features_;
+  probe_mode const mode_;
+
+  // Which roles we look for. Bytes that have none of them are other.
+  bool const find_classes_;
+  bool const find_payload_;
+
+  // State of the random number generator that picks payload samples.
+  uint32_t random_ = 0x9E3779B9;
+
+  struct known_role {
+    bool valid = false;
+    byte_role role = byte_role::other;
+
+    // The candidate that the role was found for. Only the bytes in front of
+    // the byte matter.
+    instruction_bytes instr {};
+  };
+
+  known_role roles_[sizeof(instruction_bytes::raw)];
+
+  // Execution attempts of the values of the byte that find_role() currently
+  // looks at.
+  execution_attempt attempts_[256];
+  bool probed_[256];
+
+  // Returns the role of the byte at pos, if it is known for the bytes in front
+  // of it.
+  known_role const *lookup(instruction_bytes const &instr, size_t pos) const;
+
+  execution_attempt probe(instruction_bytes const &instr, size_t pos, uint8_t value);
+
+  // Returns true, if all samples behave like the smallest value of their class.
+  bool has_classes(instruction_bytes const &instr, size_t pos, byte_role role,
+                   uint8_t const *samples, size_t sample_count);
+
+  // Returns true, if the byte at pos looks like a ModRM byte.
+  bool is_modrm_at(instruction_bytes const &instr, size_t pos);
+
+  // Returns true, if no value of the byte at pos seems to make a difference.
+  bool is_payload_at(instruction_bytes const &instr, size_t pos);
+
+  byte_role find_role(instruction_bytes const &instr, size_t pos);
+
+public:
+
+  // Return the role of the byte at pos. The first time a byte is seen after
+  // the same bytes in front of it, this executes a couple of probes to find it
+  // out.
+  byte_role role_of(instruction_bytes const &candidate, size_t pos);
+
+  // Returns true, if the candidate behaves like a smaller candidate, which only
+  // differs in the byte at pos. The same is true for all candidates that start
+  // with the first pos + 1 bytes of this one. For payload bytes, it is also
+  // true for all larger values of the byte.
+  bool is_redundant(instruction_bytes const &candidate, size_t pos);
+
+  byte_roles(cpu_features const &features, probe_mode mode, bool find_classes, bool find_payload)
+    : features_(features), mode_(mode), find_classes_(find_classes), find_payload_(find_payload)
+  {}
+};
+
+struct byte_role_statistics {
+  // The number of candidates that were skipped, because a smaller value of
+  // their ModRM or SIB byte is in the same class.
+  uint64_t redundant_candidates = 0;
+
+  // The number of times the remaining values of a payload byte were skipped.
+  uint64_t payload_subtrees = 0;
+};
+
+// Return the statistics of all CPUs added up.
+byte_role_statistics const &get_byte_role_statistics();
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+
+// Compresses output before it goes to the output device, when the device is
+// too slow to keep up. Lines of instructions repeat most of the line before
+// them, so this takes a fraction of the bytes. Each write of the output buffer
+// becomes a frame that can be decompressed on its own:
+//
+//   01        Starts a frame. Text output never contains this byte. Binary
+//             records can, but their blocks start with 00 and say how long
+//             they are, so tools skip over them. Everything else outside of
+//             frames is passed on as it is. See record_output.
+//   L L       The length of the compressed data, least significant byte first.
+//   data      The compressed data as sequences in the LZ4 block format: a
+//             token with the number of literals in the upper and the match
+//             length minus 4 in the lower four bits, more bytes of either
+//             length if its nibble is F, the literals, and the offset of the
+//             match as two bytes. The last sequence has no match.
+//   A B       The Fletcher-16 checksum of the decompressed data.
+//
+// See tools/baresifter-decompress for a decompressor.
+
+// The most data that fits into a frame.
+const size_t max_frame_data = 4096;
+
+// Compress data into a frame. Returns the frame, which stays valid until the
+// next call. length is at most max_frame_data.
+const char *compress_frame(const char *data, size_t length, size_t &frame_length);
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+
+// Application processors don't write to the output device themselves, because
+// it cannot be used from multiple CPUs at once. Instead, each of them has a
+// buffer that the boot CPU drains.
+
+// Start buffering the output of application processors. Until then, every CPU
+// prints directly.
+void start_output_buffering();
+
+// Returns true, if the output of the current CPU goes into its buffer.
+bool is_output_buffered();
+
+// Append to the buffer of the current CPU. The boot CPU only sees complete
+// lines. Waits while the buffer is full.
+void buffer_output(const char *str);
+
+// Append data that may contain any byte to the buffer of the current CPU. The
+// boot CPU sees all of it at once. Waits while the buffer is full.
+void buffer_output(const char *data, size_t length);
+
+// Print everything application processors have buffered. Only call this on the
+// boot CPU.
+void drain_output_buffers();
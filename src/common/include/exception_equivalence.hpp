@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "execution_attempt.hpp"
+#include "search.hpp"
+
+// A pair of exceptions that we learned and where it applies: every candidate
+// that starts with the first at bytes of the candidate where we learned it.
+struct learned_exception_pair {
+  uint8_t a = 0;
+  uint8_t b = 0;
+  uint8_t at = 0;
+};
+
+// What exception_equivalence remembers about the candidates so far. A search
+// that continues somewhere else takes this along. See print_checkpoint().
+struct exception_memory {
+  // The attempt before the last one.
+  execution_attempt before_last {};
+
+  // Each pair has its own subtree. They all contain last_candidate, so when
+  // the search leaves the first at bytes of it, it has left the subtree of
+  // the pair as well.
+  static const size_t max_learned = 32;
+  learned_exception_pair learned[max_learned] {};
+  size_t learned_count = 0;
+  instruction_bytes last_candidate {};
+};
+
+// Decides whether a change of the execution attempt between two consecutive
+// candidates is interesting. Some exceptions only depend on the data an
+// instruction touches. Flipping between them at the same length says nothing
+// about the instruction, but restarts the search below it.
+//
+// A table holds the pairs of exceptions that are the same in this sense.
+// Optionally, we learn more pairs: if the exception goes from A to B and back
+// to A at the same length, A and B are the same for the rest of the subtree
+// where this happened.
+class exception_equivalence {
+  // Bit b of same_[a] is set, if exceptions a and b are the same.
+  uint32_t same_[32] {};
+
+  bool learn_ = false;
+
+  exception_memory memory_ {};
+
+  // Forget the pairs whose subtree doesn't contain the candidate.
+  void leave_subtrees(instruction_bytes const &candidate);
+
+  bool is_learned(uint8_t a, uint8_t b) const;
+  void learn(uint8_t a, uint8_t b, size_t at);
+
+public:
+
+  // Make the two exceptions the same.
+  void add(uint8_t a, uint8_t b)
+  {
+    if (a < 32 and b < 32) {
+      same_[a] |= 1u << b;
+      same_[b] |= 1u << a;
+    }
+  }
+
+  // Forget all pairs.
+  void clear()
+  {
+    for (auto &s : same_)
+      s = 0;
+  }
+
+  void set_learning(bool learn) { learn_ = learn; }
+
+  bool is_same(uint8_t a, uint8_t b) const { return a < 32 and b < 32 and (same_[a] & (1u << b)); }
+  bool is_learning() const { return learn_; }
+
+  // Return what we remember at the candidate, which is where the search is.
+  exception_memory const &memory(instruction_bytes const &candidate)
+  {
+    leave_subtrees(candidate);
+    return memory_;
+  }
+
+  // Continue with what memory() returned.
+  void restore(exception_memory const &memory) { memory_ = memory; }
+
+  // Returns true, if the change from the last attempt to the current one is
+  // interesting. The candidate is the current one and pos is the byte that the
+  // search increments.
+  bool is_interesting_change(execution_attempt const &last, execution_attempt const &now,
+                             instruction_bytes const &candidate, size_t pos);
+
+  exception_equivalence()
+  {
+    // FXSAVE has an alignment restriction on its memory operand. It flips
+    // between #GP and #PF depending on the memory operand.
+    add(0xD, 0xE);
+  }
+};
@@ -4,10 +4,14 @@
 #include <cstdint>
 
 enum : uint32_t {
+  IA32_APIC_BASE = 0x1B,
   IA32_EFER = 0xC0000080,
 };
 
 enum : uint64_t {
+  IA32_APIC_BASE_EXTD = 1 << 10,
+  IA32_APIC_BASE_EN = 1 << 11,
+
   IA32_EFER_NXE = 1 << 11,
 };
 
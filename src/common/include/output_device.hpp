@@ -1,11 +1,45 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+
+class uart;
+
+// The serial port that output goes to on bare metal. See uart.
+struct serial_settings {
+  uint16_t port = 0x3f8;
+  uint16_t divisor = 1;
+
+  // Zero means the size that the UART reports.
+  size_t fifo_size = 0;
+
+  // Send in the background when the UART interrupts with this IRQ. Zero means
+  // waiting for the UART instead.
+  size_t irq = 0;
+};
+
 class output_device {
 public:
 
   virtual void putc(char c) = 0;
   virtual void puts(const char *s);
 
+  // Write a number of characters at once. Devices that can take more than one
+  // character per I/O operation override this.
+  virtual void write(const char *data, size_t length);
+
+  // Wait until everything that was written is sent. Devices that send in the
+  // background override this.
+  virtual void sync() {}
+
+  // Use a serial port with the given settings. Devices that are not serial
+  // ports ignore this.
+  virtual void configure(serial_settings const &) {}
+
+  // The serial port that output goes to. Null for devices that are not
+  // serial ports.
+  virtual uart *serial_port() { return nullptr; }
+
   // Factory method.
   static output_device *make();
 };
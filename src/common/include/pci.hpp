@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+
+// PCI configuration space with configuration mechanism 1 (ports CF8 and CFC),
+// which every PC has. We only look for devices that firmware has already
+// assigned resources to.
+
+enum : uint8_t {
+  PCI_VENDOR_ID = 0x00,
+  PCI_DEVICE_ID = 0x02,
+  PCI_COMMAND = 0x04,
+  PCI_HEADER_TYPE = 0x0E,
+  PCI_BAR0 = 0x10,
+};
+
+enum : uint16_t {
+  PCI_COMMAND_IO = 0x01,
+  PCI_COMMAND_MASTER = 0x04,
+};
+
+enum : uint32_t {
+  PCI_BAR_IO = 0x01,
+  PCI_BAR_IO_MASK = ~0x03U,
+};
+
+struct pci_function {
+  uint8_t bus = 0;
+  uint8_t device = 0;
+  uint8_t function = 0;
+
+  uint32_t read32(uint8_t offset) const;
+  uint16_t read16(uint8_t offset) const;
+  void write16(uint8_t offset, uint16_t value) const;
+};
+
+// Find the first function with the given vendor and device ID. Returns false,
+// if there is none.
+bool find_pci_function(uint16_t vendor, uint16_t device, pci_function &found);
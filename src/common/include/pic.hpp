@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+
+// The legacy 8259 interrupt controllers. We only use them for devices that
+// interrupt the boot CPU, like the serial port, so everything else keeps
+// polling. Exceptions take the vectors below pic_vector_base.
+
+// The vector of IRQ 0. The 16 IRQs follow it.
+const size_t pic_vector_base = 32;
+const size_t pic_irq_count = 16;
+
+// Call handler for each interrupt of the IRQ and let the IRQ through to the
+// boot CPU. The handler runs with interrupts disabled.
+void set_irq_handler(size_t irq, void (*handler)());
+
+// Called by the interrupt entry code for vectors from pic_vector_base.
+void handle_irq(size_t irq);
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "probe.hpp"
+#include "search.hpp"
+
+struct cpu_features;
+
+// Skips the subtrees of prefixed opcodes that behave like the same opcode
+// without prefixes. For each opcode, we keep a summary of the execution
+// attempts of the unprefixed opcode with a couple of probe tails. A prefixed
+// opcode that gives the same attempts with these tails is skipped with
+// everything after it.
+//
+// Skipped opcodes are logged with one line for each sequence of prefixes.
+class prefix_pruning {
+  cpu_features const &features_;
+  probe_mode const mode_;
+
+  // The prefixes of the opcodes that we skipped, but didn't log yet.
+  instruction_bytes log_prefixes_ {};
+  size_t log_length_ = 0;
+  size_t log_count_ = 0;
+
+  void log_skipped(instruction_bytes const &candidate, size_t prefixes);
+
+public:
+
+  // Returns true, if the candidate is the first one of a prefixed opcode whose
+  // subtree behaves like the one of the unprefixed opcode. The candidate has
+  // the given number of prefix bytes and the search increments the byte at
+  // pos.
+  bool is_redundant(instruction_bytes const &candidate, size_t pos, size_t prefixes);
+
+  // Print the log line that is still pending.
+  void flush_log();
+
+  prefix_pruning(cpu_features const &features, probe_mode mode)
+    : features_(features), mode_(mode)
+  {}
+
+  ~prefix_pruning() { flush_log(); }
+};
+
+// Return the number of prefixed opcodes that were skipped on all CPUs.
+uint64_t get_pruned_opcodes();
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "execution_attempt.hpp"
+#include "search.hpp"
+
+struct cpu_features;
+
+// How find_instruction_length() searches for the length of an instruction.
+enum class probe_mode {
+  // Try every length from 1 to 15 until the instruction is completely fetched.
+  linear,
+
+  // Binary search for the length.
+  binary,
+
+  // Execute the whole candidate once and take the length from where the
+  // single-step trap hits. Falls back to binary search, if this doesn't work
+  // out.
+  infer,
+
+  // Like linear, but execute all lengths in one batch with
+  // execute_user_batch(). This needs all user pages to be mapped, so memory
+  // operands on them don't fault like they do with the other modes.
+  batch,
+
+  // Do all of the above and complain if they disagree with the linear search.
+  // Each of them is compared to a linear search with the same user pages
+  // mapped, so this checks the other modes as they run on their own.
+  verify,
+};
+
+// Returns true, if the probe mode needs all user pages to be mapped.
+inline bool needs_user_pages(probe_mode mode)
+{
+  return mode == probe_mode::batch;
+}
+
+struct probe_statistics {
+  // The number of times we exited to user space.
+  uint64_t executions = 0;
+
+  // The number of lengths we didn't probe, because we already knew that a
+  // prefix of the candidate is an incomplete instruction. The linear search
+  // would have executed each of them once. The other probe modes execute fewer
+  // lengths to begin with, so they save less than this.
+  uint64_t skipped_executions = 0;
+
+  // The number of lengths that were inferred from the single-step trap.
+  uint64_t inferred = 0;
+};
+
+// Return the statistics of all CPUs added up.
+probe_statistics const &get_probe_statistics();
+
+// Find the length of an instruction by executing it in user space. The first
+// known_incomplete bytes of the instruction must be known to not form a
+// complete instruction.
+execution_attempt find_instruction_length(cpu_features const &features,
+                                          probe_mode mode,
+                                          instruction_bytes const &instr,
+                                          size_t known_incomplete = 0);
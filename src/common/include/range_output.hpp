@@ -0,0 +1,20 @@
+#pragma once
+
+#include "execution_attempt.hpp"
+#include "search.hpp"
+
+// Text output for output=ranges. Instructions that only differ in their last
+// byte, follow each other without a gap and have the same length and exception
+// are printed as one line with the range of last bytes:
+//
+//   EXC 06 OK | 0F 0D [C0-FF]
+//
+// This is the same as printing each of them on a line of its own. Each CPU
+// holds back its last instruction until it knows whether the next one
+// continues the range. analyze expands ranges again.
+
+// Print an instruction or add it to the range of the current CPU.
+void print_range(instruction_bytes const &instr, execution_attempt const &attempt);
+
+// Print the range of the current CPU, if it has one.
+void flush_ranges();
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "execution_attempt.hpp"
+#include "search.hpp"
+
+// Binary records of execution attempts for output=binary. They take about a
+// third of the bytes of what print_instruction() prints. Each CPU collects its
+// records in blocks:
+//
+//   00        Starts a block. Text output never contains this byte.
+//   N         The number of records in the block.
+//   records   N times: a byte with the exception in the upper and the length
+//             in the lower four bits, followed by the instruction bytes. A
+//             length of F is printed as ?? with 15 bytes in text. An exception
+//             of F means that the exception follows in a byte of its own.
+//   A B       The Fletcher-16 checksum of N and the records.
+//
+// See analyze/src/binary.rs for a decoder.
+
+// Add a record to the block of the current CPU. The block is printed when it is
+// full or before the CPU prints anything else.
+void print_record(instruction_bytes const &instr, execution_attempt const &attempt);
+
+// Print the block of the current CPU, if it has records.
+void flush_records();
@@ -13,20 +13,207 @@ struct instruction_bytes {
   {}
 };
 
+// Returns true, if a comes before b in the order of the search.
+inline bool is_before(instruction_bytes const &a, instruction_bytes const &b)
+{
+  for (size_t i = 0; i < sizeof(a.raw); i++) {
+    if (a.raw[i] != b.raw[i])
+      return a.raw[i] < b.raw[i];
+  }
+
+  return false;
+}
+
+// Returns true, if all bytes are zero.
+inline bool is_zero(instruction_bytes const &instr)
+{
+  for (auto b : instr.raw) {
+    if (b != 0)
+      return false;
+  }
+
+  return true;
+}
+
+// A part of the search from start up to, but not including, end. An end of all
+// zeroes means searching until we run out of candidates.
+struct search_range {
+  instruction_bytes start;
+  instruction_bytes end;
+};
+
+// Where a search is, so it can continue from there later.
+struct search_position {
+  instruction_bytes current;
+  size_t increment_at;
+};
+
+// Return the prefix group of a byte or -1, if it is not a prefix or prefixes of
+// its group are not detected.
+constexpr int opcode_to_prefix_group(uint8_t byte, size_t detect_prefixes_)
+{
+  int group = -1;
+
+  switch (byte) {
+  case 0xF0:                    // LOCK
+  case 0xF2:                    // REPNE
+  case 0xF3:                    // REP
+    if (detect_prefixes_ & (1<<0)) //To detect?
+    {
+      group = 0;
+    }
+    break;
+  case 0x2E:                    // CS
+  case 0x36:                    // SS
+  case 0x3e:                    // DS
+  case 0x26:                    // ES
+  case 0x64:                    // FS
+  case 0x65:                    // GS
+    if (detect_prefixes_ & (1<<1)) //To detect?
+    {
+      group = 1;
+    }
+    break;
+  case 0x66:                    // operand size override
+    if (detect_prefixes_ & (1<<2)) //To detect?
+    {
+      group = 2;
+    }
+    break;
+  case 0x67:                    // address size override
+    if (detect_prefixes_ & (1<<3)) //To detect?
+    {
+      group = 3;
+    }
+    break;
+  case 0x40 ... 0x4F:           // REX prefixes
+    if (detect_prefixes_ & (1<<4)) //To detect?
+    {
+      group = 4;
+    }
+    break;
+  }
+
+  return group;
+}
+
 class prefix_group_lut {
 public:
-    int8_t data[256];
+    int8_t data[256] {};
 
-    prefix_group_lut(size_t detect_prefixes_); //Prototype!
+    constexpr prefix_group_lut(size_t detect_prefixes_)
+    {
+      for (size_t i = 0; i < 256; i++) {
+        data[i] = (int8_t)opcode_to_prefix_group((uint8_t)i, detect_prefixes_);
+      }
+    }
 };
 
-class search_engine {
+// A prefix automaton that accepts the prefix sequences that satisfy the prefix
+// constraints of a search. Its state is the group of the last prefix and
+// whether there is room for another prefix.
+class prefix_automaton {
+public:
+  const size_t max_prefixes;    //How many prefixes to use at once.
+  prefix_group_lut group_lut;   //What group lut to use!
+
+  // For each state, the smallest acceptable byte that is not smaller than the
+  // index or zero, if there is none. A byte is acceptable, if it maps to
+  // itself. Zero is never a prefix, so it is always acceptable.
+  uint8_t next_acceptable[6 * 2][256] {};
+
+  static constexpr size_t state(int last_group, bool room)
+  {
+    return (last_group + 1) * 2 + room;
+  }
+
+  constexpr prefix_automaton(size_t max_prefixes_, size_t used_prefixes, size_t detect_prefixes)
+    : max_prefixes(max_prefixes_), group_lut(detect_prefixes)
+  {
+    for (int last_group = -1; last_group < 5; last_group++) {
+      for (int room = 0; room < 2; room++) {
+        auto &next = next_acceptable[state(last_group, room)];
+        uint8_t acceptable = 0;
+
+        for (size_t byte = 0xFF; byte > 0; byte--) {
+          int group = group_lut.data[byte];
+
+          // Duplicated prefixes make the search space explode without
+          // generating insight. Also enforce order on prefixes to further
+          // reduce search space. And also filter out prefixes that are
+          // declared not to be used.
+          if (group < 0 or (room and group > last_group and (used_prefixes & (1 << group))))
+            acceptable = (uint8_t)byte;
+
+          next[byte] = acceptable;
+        }
+      }
+    }
+  }
+};
+
+// The prefix count of search engines that are configured at runtime. See
+// basic_search_engine.
+constexpr int configured_prefixes = -1;
+
+// Where a search engine keeps its prefix automaton. Engines for a fixed number
+// of prefixes and the default prefix masks share one that is computed at
+// compile time.
+template <int PREFIXES>
+class prefix_automaton_storage {
+  static constexpr prefix_automaton automaton_ { PREFIXES, 0xFF, 0xFF };
+
+public:
+  static constexpr prefix_automaton const &automaton() { return automaton_; }
+  static constexpr size_t max_prefixes() { return PREFIXES; }
+
+  prefix_automaton_storage(size_t, size_t, size_t) {}
+};
+
+template <int PREFIXES>
+constexpr prefix_automaton prefix_automaton_storage<PREFIXES>::automaton_;
+
+template <>
+class prefix_automaton_storage<configured_prefixes> {
+  prefix_automaton automaton_;
+
+public:
+  prefix_automaton const &automaton() const { return automaton_; }
+  size_t max_prefixes() const { return automaton_.max_prefixes; }
+
+  prefix_automaton_storage(size_t max_prefixes, size_t used_prefixes, size_t detect_prefixes)
+    : automaton_(max_prefixes, used_prefixes, detect_prefixes)
+  {}
+};
+
+// Returns true, if a search with these options can use the search engine that
+// is specialized for the given number of prefixes.
+inline bool has_specialized_search(int prefixes, size_t max_prefixes,
+                                   size_t used_prefixes, size_t detect_prefixes)
+{
+  return max_prefixes == (size_t)prefixes and
+    (used_prefixes & 0x1F) == 0x1F and (detect_prefixes & 0x1F) == 0x1F;
+}
+
+// Enumerates instruction candidates. PREFIXES is the maximum number of prefixes
+// for an engine that is specialized at compile time and only supports the
+// default prefix masks. With configured_prefixes, everything is configured at
+// runtime instead.
+template <int PREFIXES>
+class basic_search_engine {
   instruction_bytes current_;
+  const instruction_bytes end_;
+  bool has_end_;
   size_t increment_at_ = 0;
 
-  const size_t max_prefixes_; //How many prefixes to use at once.
-  const size_t used_prefixes_; //What prefixes to scan through.
-  prefix_group_lut group_lut_; //What group lut to use!
+  prefix_automaton_storage<PREFIXES> prefixes_;
+
+  // Returns true, if the prefixes starting at pos are acceptable after the
+  // prefixes in front of them.
+  bool are_acceptable_from(size_t pos, int last_group, size_t count) const;
+
+  // Returns true, if the current candidate is at or after the end.
+  bool is_after_end() const;
 
 public:
 
@@ -34,19 +221,129 @@ public:
   // the search is done.
   bool find_next_candidate();
 
+  // Skip to the first candidate that satisfies our prefix constraints, unless
+  // the current one does. Returns false, if there is no such candidate before
+  // the end.
+  bool find_first_candidate();
+
   // Reset the incrementing position after an interesting instruction was found.
   void start_over(size_t length);
 
   // Clear any bytes after the given position.
   void clear_after(size_t pos);
 
+  // Skip the remaining values of the byte that we increment. The next
+  // candidate increments the byte in front of it.
+  void skip_remaining()
+  {
+    current_.raw[increment_at_] = 0xFF;
+  }
+
   // Return the current instruction candidate.
   instruction_bytes const &get_candidate() const
   {
     return current_;
   }
 
-  search_engine(size_t max_prefixes = 0, size_t used_prefixes = 0xFF, size_t detect_prefixes = 0xFF, instruction_bytes const &start = {})
-      : current_(start), max_prefixes_(max_prefixes), used_prefixes_(used_prefixes), group_lut_(detect_prefixes)
-  {}
+  // Return the number of prefix bytes in front of the current candidate.
+  size_t prefix_length() const;
+
+  search_position get_position() const
+  {
+    return { current_, increment_at_ };
+  }
+
+  // Continue the search from a position that get_position() returned. The next
+  // candidate is the one after the position.
+  void set_position(search_position const &position)
+  {
+    current_ = position.current;
+    increment_at_ = position.increment_at < sizeof(current_.raw) ? position.increment_at : 0;
+  }
+
+  basic_search_engine(size_t max_prefixes = 0, size_t used_prefixes = 0xFF, size_t detect_prefixes = 0xFF,
+                      search_range const &range = {});
+};
+
+using search_engine = basic_search_engine<configured_prefixes>;
+
+// Draws random candidates that satisfy the prefix constraints of a search. The
+// number of prefixes is uniformly distributed, so long prefix sequences are as
+// common as short ones. The bytes after the prefixes are random where the mask
+// has bits set and come from the fixed bytes otherwise. A zero mask makes all
+// bits random. The same seed always gives the same candidates. See
+// basic_search_engine for PREFIXES.
+template <int PREFIXES>
+class basic_random_search {
+  instruction_bytes current_;
+  const instruction_bytes fixed_;
+  const instruction_bytes mask_;
+  uint64_t state_;
+
+  prefix_automaton_storage<PREFIXES> prefixes_;
+
+  // The prefixes that may be used, by group.
+  uint8_t group_bytes_[5][16];
+  size_t group_size_[5] {};
+  size_t used_groups_ = 0;
+
+  uint64_t next_random();
+
+  // Return a random number below the given one.
+  size_t random_below(size_t n);
+
+  // Return a random byte for the given position after the prefixes.
+  uint8_t random_byte(size_t pos);
+
+public:
+
+  // Draw the next candidate and return it.
+  instruction_bytes const &next_candidate();
+
+  basic_random_search(uint64_t seed, size_t max_prefixes = 0, size_t used_prefixes = 0xFF,
+                      size_t detect_prefixes = 0xFF, instruction_bytes const &fixed = {},
+                      instruction_bytes const &mask = {});
+};
+
+using random_search = basic_random_search<configured_prefixes>;
+
+// Estimates how much work the search does in each part of the instruction
+// space. The unit of work is the subtree below one opcode after a valid
+// sequence of prefixes. The escape bytes 0F, 0F 38 and 0F 3A weigh as much as
+// the opcodes of their maps, and parts can end inside of them.
+class search_estimate {
+  const size_t max_prefixes_;
+  const size_t used_prefixes_;
+  prefix_group_lut group_lut_;
+
+  // How many bytes are in each prefix group and how many aren't prefixes.
+  size_t group_size_[5] {};
+  size_t opcodes_ = 0;
+
+  // The work below a sequence of count prefixes, the last of which is in the
+  // given group.
+  uint64_t work_after_prefixes(size_t count, int last_group) const;
+
+  // The work below the first length bytes of the candidate. Sets divisible, if
+  // this is a sequence of prefixes or escape bytes that can be split further.
+  uint64_t work_below(instruction_bytes const &candidate, size_t length,
+                      bool &divisible) const;
+
+public:
+
+  // The work for all candidates before the given one.
+  uint64_t work_before(instruction_bytes const &candidate) const;
+
+  // The work of the whole search.
+  uint64_t total_work() const { return work_after_prefixes(0, -1); }
+
+  // Return a candidate that has about the given amount of work before it. If
+  // the work is more than there is, this returns all zeroes.
+  instruction_bytes find_boundary(uint64_t work) const;
+
+  // Split the range into parts with about the same amount of work and return
+  // one of them.
+  search_range split(search_range const &range, size_t part, size_t parts) const;
+
+  search_estimate(size_t max_prefixes = 0, size_t used_prefixes = 0xFF, size_t detect_prefixes = 0xFF);
 };
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+
+#include "work_item.hpp"
+
+// Hands out slices of the search of a range to all CPUs, so the parts of the
+// instruction space that find the most come first. The range is split into the
+// subtrees of its first bytes. Each subtree remembers how many interesting
+// candidates it found per execution, with older slices counting less.
+// Subtrees that were never searched go first, then the ones with the best
+// yield. When a subtree of a first byte is taken again, it is split into the
+// subtrees of its second bytes.
+//
+// Every subtree is searched to its end eventually, so the whole range is
+// covered. A subtree that is split off starts by executing about the last
+// candidate of the subtree in front of it. So it mostly prints its first
+// candidate only, if the walk of the whole range would have printed it.
+
+// How many candidates a CPU executes of a subtree before it takes the next one.
+const size_t subtree_slice = 4096;
+
+// Split the range into the subtrees of its first bytes. Call this before any
+// CPU takes a subtree.
+void start_subtree_schedule(search_range const &range);
+
+// Take the subtree with the best yield. Returns false, if all subtrees are done
+// or taken by other CPUs.
+bool take_subtree(size_t &id, work_item &work);
+
+// Give a subtree back after searching a slice of it. work says where the search
+// stopped.
+void return_subtree(size_t id, work_item const &work, size_t executions, size_t found, bool done);
+
+// Returns true, if all subtrees are done.
+bool is_schedule_done();
+
+// Return how many subtrees of first bytes were split.
+size_t get_split_subtrees();
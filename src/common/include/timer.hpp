@@ -0,0 +1,10 @@
+#pragma once
+
+#include <cstdint>
+
+// Return the frequency of the TSC in Hz. The first call measures it using the
+// PIT, which takes 10ms.
+uint64_t get_tsc_frequency();
+
+// Busy-wait for the given number of microseconds.
+void delay_us(uint64_t us);
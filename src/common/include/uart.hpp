@@ -0,0 +1,188 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "x86.hpp"
+
+// A 16550 compatible serial port with 8 data bits, no parity and one stop bit.
+// The transmitter fills the whole FIFO each time it is empty instead of
+// waiting before every byte.
+class uart {
+  uint16_t base_port_;
+
+  // How many bytes the transmit FIFO takes and how many more we can put into
+  // it without asking.
+  size_t fifo_size_;
+  size_t tx_room_ = 0;
+
+  enum class uart_reg {
+    THR = 0,
+    RBR = 0,
+    DLL = 0,
+    DLH = 1,
+    IER = 1,
+    IIR = 2,
+    FCR = 2,
+    LCR = 3,
+    MCR = 4,
+    LSR = 5,
+  };
+
+  enum {
+    LCR_DLAB = 0x80,
+    LCR_8BITDATA = 0x03,
+    LCR_1BITSTOP = 0,
+
+    FCR_ENABLE_FIFO = 1,
+    FCR_CLEAR_RX = 2,
+    FCR_CLEAR_TX = 4,
+    FCR_64BYTE_FIFO = 0x20,
+
+    IIR_FIFO_MASK = 0xC0,
+    IIR_FIFO_ENABLED = 0xC0,
+    IIR_64BYTE_FIFO = 0x20,
+
+    MCR_DTS = 1,
+    MCR_RTS = 2,
+
+    // On PCs, the IRQ of the UART only reaches the PIC with this set.
+    MCR_OUT2 = 8,
+
+    IER_TX_EMPTY = 0x02,
+
+    LSR_CAN_RX = 0x01,
+    LSR_CAN_TX = 0x20,
+    LSR_TX_EMPTY = 0x40,
+  };
+
+  void out(uart_reg reg, uint8_t v)
+  {
+    outb(base_port_ + (uint16_t)reg, v);
+  }
+
+  uint8_t in(uart_reg reg)
+  {
+    return inb(base_port_ + (uint16_t)reg);
+  }
+
+  void program_divisor(uint16_t divisor)
+  {
+    out(uart_reg::LCR, LCR_DLAB);
+    out(uart_reg::DLL, divisor & 0xFF);
+    out(uart_reg::DLH, divisor >> 8);
+  }
+
+  // Return the FIFO size that the UART reports.
+  size_t detect_fifo_size()
+  {
+    uint8_t const iir = in(uart_reg::IIR);
+
+    if ((iir & IIR_FIFO_MASK) != IIR_FIFO_ENABLED)
+      return 1;
+    else if (iir & IIR_64BYTE_FIFO)
+      return 64;
+    else
+      return 16;
+  }
+
+public:
+
+  // Return how many characters put() can send without waiting. With a FIFO,
+  // the transmitter can take a FIFO full of characters each time it is empty.
+  size_t room()
+  {
+    if (tx_room_ == 0 and (in(uart_reg::LSR) & LSR_CAN_TX))
+      tx_room_ = fifo_size_;
+
+    return tx_room_;
+  }
+
+  // Send a character. Only call this, if there is room().
+  void put(char c)
+  {
+    out(uart_reg::THR, (uint8_t)c);
+    tx_room_--;
+  }
+
+  // Send a character. Waits until the transmitter can take it.
+  void putc(char c)
+  {
+    while (room() == 0)
+      pause();
+
+    put(c);
+  }
+
+  // Interrupt when the transmitter is empty.
+  void set_tx_interrupt(bool enabled)
+  {
+    out(uart_reg::IER, enabled ? IER_TX_EMPTY : 0);
+    out(uart_reg::MCR, MCR_RTS | MCR_DTS | (enabled ? MCR_OUT2 : 0));
+  }
+
+  // Reading IIR acknowledges that the transmitter is empty.
+  void acknowledge_interrupt()
+  {
+    in(uart_reg::IIR);
+  }
+
+  // Wait until every character is sent.
+  void flush()
+  {
+    while (not (in(uart_reg::LSR) & LSR_TX_EMPTY))
+      pause();
+  }
+
+  // Change the baud rate. Waits until every character is sent, because they
+  // would go out garbled, but keeps the FIFO as it is.
+  void set_divisor(uint16_t divisor)
+  {
+    flush();
+    program_divisor(divisor);
+    out(uart_reg::LCR, LCR_8BITDATA | LCR_1BITSTOP);
+  }
+
+  // Fill the FIFO with this many characters at a time. Zero means the size
+  // that the UART reports.
+  void set_fifo_size(size_t fifo_size)
+  {
+    fifo_size_ = fifo_size ? fifo_size : detect_fifo_size();
+    tx_room_ = 0;
+  }
+
+  size_t fifo_size() const { return fifo_size_; }
+  uint16_t port() const { return base_port_; }
+
+  // Receive a character. Waits until there is one.
+  char getc()
+  {
+    while (not (in(uart_reg::LSR) & LSR_CAN_RX))
+      pause();
+
+    return (char)in(uart_reg::RBR);
+  }
+
+  // The baud rate is 115200 divided by the divisor. A FIFO size of zero means
+  // the size that the UART reports: 64 bytes for a 16750, 16 bytes for a
+  // 16550A and none for older ones.
+  // Setting up the FIFO drops what it holds, so we first wait until whatever
+  // the port sent before us is out. Use set_divisor() and set_fifo_size() to
+  // change a UART that is already set up.
+  uart(uint16_t base_port, uint16_t divisor = 1, size_t fifo_size = 0)
+    : base_port_(base_port), fifo_size_(fifo_size)
+  {
+    flush();
+    program_divisor(divisor);
+
+    // A 16750 only enables its 64 byte FIFO while DLAB is set.
+    out(uart_reg::FCR, FCR_ENABLE_FIFO | FCR_CLEAR_RX | FCR_CLEAR_TX | FCR_64BYTE_FIFO);
+
+    out(uart_reg::LCR, LCR_8BITDATA | LCR_1BITSTOP);
+    out(uart_reg::IER, 0);      // Disable all interrupts
+    out(uart_reg::MCR, MCR_RTS | MCR_DTS);
+
+    if (fifo_size_ == 0)
+      fifo_size_ = detect_fifo_size();
+  }
+};
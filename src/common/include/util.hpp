@@ -9,6 +9,16 @@
 template <typename T, size_t N>
 constexpr size_t array_size(T(&)[N]) { return N; }
 
+// The size of a cache line on every CPU we run on.
+const size_t cache_line_size = 64;
+
+// A value on a cache line of its own. Counters that each CPU updates go into
+// these, so CPUs don't take the line from each other on every update.
+template <typename T>
+struct alignas(cache_line_size) cache_line_aligned {
+  T value {};
+};
+
 // Return the bits in the range from high (non-inclusive) to low (inclusive)
 // extracted from value.
 inline uint64_t bit_select(int high, int low, uint64_t value)
@@ -16,8 +26,42 @@ inline uint64_t bit_select(int high, int low, uint64_t value)
   return (value >> low) & ((1UL << (high - low)) - 1);
 }
 
+// Output of the boot CPU goes through a buffer, so the output device gets whole
+// lines at once.
 void print(const char *s);
 
+// Print data that may contain any byte, like binary records. The end of the
+// data counts as the end of a line.
+void write_output(const char *data, size_t length);
+
+// Write the buffered output to the output device. This happens after every
+// line, once the given number of bytes are buffered. The default of zero
+// writes every line right away. Sizes larger than the buffer mean a full
+// buffer.
+void set_output_flush_size(size_t size);
+void flush_output();
+
+// Write the buffered output and wait until the output device has sent all of
+// it.
+void finish_output();
+
+// Change the settings of the serial port, if output goes to one. Output that
+// is already buffered is written with the old settings.
+struct serial_settings;
+void configure_output(serial_settings const &settings);
+
+// Write data to the output device right after the buffered output and wait
+// until it is sent. It is neither buffered nor compressed. See work_queue.
+void write_unbuffered_output(const char *data, size_t length);
+
+// The UART that output goes to or null, if it doesn't go to a serial port.
+class uart;
+uart *output_serial_port();
+
+// Compress each write of the buffered output. Output that is already buffered
+// is written as it is. See compressed_output.
+void set_output_compression(bool compress);
+
 struct formatted_int {
   uint64_t v;
   unsigned base;
@@ -36,6 +80,25 @@ inline formatted_int hex(uint64_t v, unsigned width = 0, bool prefix = true)
 //void print(uint64_t v);
 void print(formatted_int const &v);
 
+// Return the value of a hex digit or -1, if it isn't one.
+int hex_digit(char c);
+
+// Parse a hex number. Stops at the first character that is not a hex digit.
+size_t parse_hex(const char *value);
+
+// Parse a string of hex digits, like 0F0D, into instruction bytes. Stops at the
+// first character that is not a hex digit.
+struct instruction_bytes;
+instruction_bytes parse_bytes(const char *value);
+
+// Write instruction bytes as a single hex string without trailing zeroes, so
+// parse_bytes() can read them back. out needs room for two digits per byte.
+// Returns the end of the string, which is not terminated.
+char *format_compact_bytes(char *out, instruction_bytes const &instr);
+
+// Print instruction bytes like format_compact_bytes().
+void print_compact_bytes(instruction_bytes const &instr);
+
 template <typename T>
 void format(T const &t)
 {
@@ -60,7 +123,7 @@ inline void assert(bool cnd, const char *s)
   }
 }
 
-// Disable interrupts and halt the CPU.
+// Write buffered output, disable interrupts and halt the CPU.
 extern "C" [[noreturn]] void wait_forever();
 
 // Execute constructors
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstddef>
+
+#include "search.hpp"
+
+// Enumerates the VEX (C5, C4), XOP (8F) and EVEX (62) prefixes field by field
+// instead of byte by byte. Every combination of map, pp, L and W (and b for
+// EVEX) comes twice: once with the register fields and extension bits that
+// select nothing and once with sampled ones. The opcode and everything after
+// it are left to the search.
+
+// Return the number of prefixes.
+size_t vex_prefix_count();
+
+// Return the range of all candidates that start with the given prefix.
+search_range vex_prefix_range(size_t index);
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstddef>
+
+// The console port of a virtio-serial device, like Qemu's virtio-serial-pci
+// with a virtconsole, over the legacy virtio interface. We only use the
+// transmit queue of the console. Each write goes to the device as whole
+// buffers with one notification, so under KVM it costs a single exit instead
+// of one per character.
+
+// Find the device and set it up. Returns false, if there is none or it cannot
+// be used.
+bool setup_virtio_console();
+
+// Queue data for the device. Only waits when all transmit buffers are in use.
+void virtio_console_write(const char *data, size_t length);
+
+// Wait until the device has taken everything.
+void virtio_console_sync();
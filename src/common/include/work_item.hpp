@@ -0,0 +1,20 @@
+#pragma once
+
+#include "exception_equivalence.hpp"
+#include "execution_attempt.hpp"
+#include "search.hpp"
+
+// A part of the search that a CPU does in one go.
+struct work_item {
+  search_range range {};
+
+  // Where to continue, if we resume from a checkpoint. See print_checkpoint().
+  // A last attempt with a length of zero is not known yet. Then the search
+  // first executes the current candidate with all bytes after the one it
+  // increments set to FF. A walk of the whole subtree of the current candidate
+  // ends with about that one.
+  bool resume = false;
+  search_position position {};
+  execution_attempt last_attempt {};
+  exception_memory exceptions {};
+};
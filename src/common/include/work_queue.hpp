@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+
+#include "search.hpp"
+
+// Asks a tool on the host for the ranges to search, so many machines can take
+// their work from one queue and finish at about the same time. See
+// tools/baresifter-queue. The kernel and the tool exchange lines over a serial
+// port:
+//
+//   next               The kernel asks for a range.
+//   work START,END     The tool hands out a range. START and END are hex bytes
+//                      without trailing zeroes, like start= and end=. An empty
+//                      END means the end of the instruction space.
+//   stop               The tool has no more ranges.
+//   done START,END     The kernel has searched the range.
+//
+// Other lines are ignored on both sides. So the port can also carry the
+// output of the kernel.
+
+// Talk to the tool over the serial port with the given I/O port. If output
+// goes to the same port, we use its UART as the output device set it up.
+void start_work_queue(uint16_t port);
+
+// Ask for the next range. Returns false, if there is none left.
+bool next_queued_work(search_range &range);
+
+// Tell the tool that we have searched the range.
+void finish_queued_work(search_range const &range);
@@ -17,10 +17,13 @@ enum : mword_t {
   PTE_P = 1 << 0,
   PTE_W = 1 << 1,
   PTE_U = 1 << 2,
+  PTE_PWT = 1 << 3,
+  PTE_PCD = 1 << 4,
   PTE_PS = 1 << 7,
 };
 
 enum : mword_t {
+  CR0_TS = 1 << 3,
   CR0_WP = 1 << 16,
   CR0_PG = 1U << 31,
 
@@ -284,6 +287,24 @@ inline void outb(uint16_t port, uint8_t data)
   asm volatile ("outb %%al, (%%dx)" :: "d" (port), "a" (data));
 }
 
+// Generic 16-bit OUT operation
+inline void outw(uint16_t port, uint16_t data)
+{
+  asm volatile ("outw %%ax, (%%dx)" :: "d" (port), "a" (data));
+}
+
+// Generic 32-bit OUT operation
+inline void outl(uint16_t port, uint32_t data)
+{
+  asm volatile ("outl %%eax, (%%dx)" :: "d" (port), "a" (data));
+}
+
+// Generic string OUT operation. Writes all bytes to the same port.
+inline void outsb(uint16_t port, const void *data, size_t length)
+{
+  asm volatile ("rep outsb" : "+S" (data), "+c" (length) : "d" (port) : "memory");
+}
+
 // Generic 8-bit IN operation
 inline uint8_t inb(uint16_t port)
 {
@@ -292,6 +313,22 @@ inline uint8_t inb(uint16_t port)
   return v;
 }
 
+// Generic 16-bit IN operation
+inline uint16_t inw(uint16_t port)
+{
+  uint16_t v;
+  asm volatile ("inw (%%dx), %%ax" : "=a" (v) : "d" (port));
+  return v;
+}
+
+// Generic 32-bit IN operation
+inline uint32_t inl(uint16_t port)
+{
+  uint32_t v;
+  asm volatile ("inl (%%dx), %%eax" : "=a" (v) : "d" (port));
+  return v;
+}
+
 inline void set_cr0(mword_t v) { asm volatile ("mov %0, %%cr0" :: "r" (v)); }
 inline void set_cr2(mword_t v) { asm volatile ("mov %0, %%cr2" :: "r" (v)); }
 inline void set_cr3(mword_t v) { asm volatile ("mov %0, %%cr3" :: "r" (v) : "memory"); }
@@ -326,3 +363,21 @@ inline void pause()
 {
   asm volatile ("pause");
 }
+
+inline void cli()
+{
+  asm volatile ("cli" ::: "memory");
+}
+
+inline void sti()
+{
+  asm volatile ("sti" ::: "memory");
+}
+
+// Returns true, if the interrupt flag is set.
+inline bool interrupts_enabled()
+{
+  mword_t flags;
+  asm volatile ("pushf ; pop %0" : "=r" (flags));
+  return flags & (1 << 9);
+}
@@ -2,6 +2,9 @@
 
 #include "cpuid.hpp"
 #include "output_device.hpp"
+#include "pic.hpp"
+#include "uart.hpp"
+#include "virtio_console.hpp"
 #include "x86.hpp"
 
 void output_device::puts(const char *s)
@@ -11,6 +14,12 @@ void output_device::puts(const char *s)
     putc(c);
 }
 
+void output_device::write(const char *data, size_t length)
+{
+  for (size_t i = 0; i < length; i++)
+    putc(data[i]);
+}
+
 class qemu_output_device : public output_device {
   static constexpr uint16_t qemu_debug_port = 0xe9;
 public:
@@ -18,78 +27,200 @@ public:
   {
     outbi<qemu_debug_port>(c);;
   }
+
+  // Under KVM, each OUT is an exit to Qemu. A string OUT is one for many
+  // characters.
+  void write(const char *data, size_t length) override
+  {
+    outsb(qemu_debug_port, data, length);
+  }
+};
+
+// Under Qemu with a virtio console, whole buffers go to the device at once.
+class virtio_output_device : public output_device {
+public:
+  void putc(char c) override
+  {
+    write(&c, 1);
+  }
+
+  void write(const char *data, size_t length) override
+  {
+    virtio_console_write(data, length);
+  }
+
+  void sync() override
+  {
+    virtio_console_sync();
+  }
 };
 
 class serial_output_device : public output_device {
-  uint16_t base_port_;
-
-  enum class uart_reg {
-    THR = 0,
-    DLL = 0,
-    DLH = 1,
-    IER = 1,
-    FCR = 2,
-    LCR = 3,
-    MCR = 4,
-    LSR = 5,
-  };
-
-  enum {
-    LCR_DLAB = 0x80,
-    LCR_8BITDATA = 0x03,
-    LCR_1BITSTOP = 0,
-
-    FCR_ENABLE_FIFO = 1,
-    FCR_CLEAR_RX = 2,
-    FCR_CLEAR_TX = 4,
-
-    MCR_DTS = 1,
-    MCR_RTS = 2,
-
-    LSR_CAN_TX = 0x20,
-  };
-
-  void out(uart_reg reg, uint8_t v)
+  uart uart_;
+
+  // With an IRQ, output waits here until the UART interrupts us, so sifting
+  // goes on while the UART sends. The positions only ever increase. The
+  // interrupt handler moves the tail.
+  char tx_ring_[8192];
+  size_t tx_head_ = 0;
+  size_t tx_tail_ = 0;
+  bool use_irq_ = false;
+
+  // The device that handles the IRQ and whether the IRQ ever came.
+  static serial_output_device *irq_device_;
+  static bool irq_seen_;
+
+  // How long we wait for the first IRQ before we poll instead. The
+  // transmitter is empty when we enable its interrupt, so the IRQ comes right
+  // away, if it comes at all.
+  static const size_t irq_timeout_pauses = 1000000;
+
+  // Send from the ring as much as the UART takes. Call this with interrupts
+  // disabled.
+  void transmit()
+  {
+    size_t const head = __atomic_load_n(&tx_head_, __ATOMIC_ACQUIRE);
+
+    while (tx_tail_ != head and uart_.room())
+      uart_.put(tx_ring_[tx_tail_++ % sizeof(tx_ring_)]);
+  }
+
+  // Send what the UART takes right now. When the UART is busy, the IRQ sends
+  // the rest. Without interrupts, calling this again and again is polling.
+  void kick()
   {
-    outb(base_port_ + (uint16_t)reg, v);
+    bool const interrupts = interrupts_enabled();
+
+    cli();
+    transmit();
+
+    if (interrupts)
+      sti();
   }
 
-  uint8_t in(uart_reg reg)
+  static void handle_irq()
   {
-    return inb(base_port_ + (uint16_t)reg);
+    __atomic_store_n(&irq_seen_, true, __ATOMIC_RELEASE);
+    irq_device_->uart_.acknowledge_interrupt();
+    irq_device_->transmit();
   }
 
 public:
 
   void putc(char c) override
   {
-    while (not (in(uart_reg::LSR) & LSR_CAN_TX))
+    write(&c, 1);
+  }
+
+  void write(const char *data, size_t length) override
+  {
+    if (not use_irq_) {
+      for (size_t i = 0; i < length; i++)
+        uart_.putc(data[i]);
+      return;
+    }
+
+    for (size_t i = 0; i < length; i++) {
+      while (tx_head_ - __atomic_load_n(&tx_tail_, __ATOMIC_ACQUIRE) == sizeof(tx_ring_)) {
+        kick();
+        pause();
+      }
+
+      tx_ring_[tx_head_ % sizeof(tx_ring_)] = data[i];
+      __atomic_store_n(&tx_head_, tx_head_ + 1, __ATOMIC_RELEASE);
+    }
+
+    kick();
+  }
+
+  void sync() override
+  {
+    while (__atomic_load_n(&tx_tail_, __ATOMIC_ACQUIRE) != tx_head_) {
+      kick();
+      pause();
+    }
+
+    uart_.flush();
+  }
+
+  void configure(serial_settings const &settings) override
+  {
+    // Everything we sent goes out with the old settings.
+    sync();
+
+    bool const interrupts = interrupts_enabled();
+
+    cli();
+    uart_.set_tx_interrupt(false);
+
+    // Only another port needs to be set up from scratch. On the same port,
+    // setting up the FIFO again would only drop what it holds.
+    if (settings.port != uart_.port()) {
+      uart_ = uart { settings.port, settings.divisor, settings.fifo_size };
+    } else {
+      uart_.set_divisor(settings.divisor);
+      uart_.set_fifo_size(settings.fifo_size);
+    }
+
+    use_irq_ = settings.irq != 0;
+
+    if (use_irq_) {
+      irq_device_ = this;
+      irq_seen_ = false;
+      set_irq_handler(settings.irq, handle_irq);
+      uart_.set_tx_interrupt(true);
+    }
+
+    // With an IRQ, the boot CPU runs with interrupts enabled from now on,
+    // except in user space.
+    if (use_irq_ or interrupts)
+      sti();
+
+    if (not use_irq_)
+      return;
+
+    for (size_t i = 0; i < irq_timeout_pauses and not __atomic_load_n(&irq_seen_, __ATOMIC_ACQUIRE); i++)
       pause();
 
-    out(uart_reg::THR, (uint8_t)c);
+    if (__atomic_load_n(&irq_seen_, __ATOMIC_ACQUIRE))
+      return;
+
+    // The IRQ is not wired up the way we were told. Without it, output would
+    // wait in the ring until the next write.
+    cli();
+    uart_.set_tx_interrupt(false);
+    use_irq_ = false;
+
+    if (interrupts)
+      sti();
+
+    puts(">>> The serial port never interrupted. Polling it instead.\n");
   }
 
-  serial_output_device(uint16_t base_port)
-    : base_port_(base_port)
+  uart *serial_port() override
   {
-    out(uart_reg::LCR, LCR_DLAB);
-    out(uart_reg::DLL, 1);      // Divisor=1 -> 115200 baud
-    out(uart_reg::DLH, 0);
-
-    out(uart_reg::LCR, LCR_8BITDATA | LCR_1BITSTOP);
-    out(uart_reg::IER, 0);      // Disable all interrupts
-    out(uart_reg::FCR, FCR_ENABLE_FIFO | FCR_CLEAR_RX | FCR_CLEAR_TX);
-    out(uart_reg::MCR, MCR_RTS | MCR_DTS);
+    return &uart_;
   }
+
+  serial_output_device(serial_settings const &settings)
+    : uart_(settings.port, settings.divisor, settings.fifo_size)
+  {}
 };
 
+serial_output_device *serial_output_device::irq_device_ = nullptr;
+bool serial_output_device::irq_seen_ = false;
+
 output_device *output_device::make()
 {
   if (running_virtualized()) {
+    static virtio_output_device virtio_output;
+    if (setup_virtio_console())
+      return &virtio_output;
+
     static qemu_output_device qemu_output;
     return &qemu_output;
   }
 
-  static serial_output_device serial_output { 0x3f8 };
+  static serial_output_device serial_output { serial_settings {} };
   return &serial_output;
 }
@@ -0,0 +1,73 @@
+#include "pci.hpp"
+#include "x86.hpp"
+
+namespace {
+
+enum : uint16_t {
+  PCI_CONFIG_ADDRESS = 0xCF8,
+  PCI_CONFIG_DATA = 0xCFC,
+};
+
+enum : uint32_t {
+  PCI_CONFIG_ENABLE = 1U << 31,
+};
+
+enum : uint8_t {
+  PCI_HEADER_MULTIFUNCTION = 0x80,
+};
+
+const uint16_t pci_no_vendor = 0xFFFF;
+
+}
+
+// Select the register and return the port its bytes start at.
+static uint16_t select_register(pci_function const &f, uint8_t offset)
+{
+  outl(PCI_CONFIG_ADDRESS, PCI_CONFIG_ENABLE | (uint32_t)f.bus << 16 |
+       (uint32_t)f.device << 11 | (uint32_t)f.function << 8 | (offset & 0xFC));
+  return PCI_CONFIG_DATA + (offset & 3);
+}
+
+uint32_t pci_function::read32(uint8_t offset) const
+{
+  return inl(select_register(*this, offset));
+}
+
+uint16_t pci_function::read16(uint8_t offset) const
+{
+  return inw(select_register(*this, offset));
+}
+
+void pci_function::write16(uint8_t offset, uint16_t value) const
+{
+  outw(select_register(*this, offset), value);
+}
+
+bool find_pci_function(uint16_t vendor, uint16_t device, pci_function &found)
+{
+  pci_function f;
+
+  for (unsigned bus = 0; bus < 256; bus++) {
+    for (unsigned dev = 0; dev < 32; dev++) {
+      f.bus = bus;
+      f.device = dev;
+      f.function = 0;
+
+      if (f.read16(PCI_VENDOR_ID) == pci_no_vendor)
+        continue;
+
+      unsigned const functions = (f.read16(PCI_HEADER_TYPE) & PCI_HEADER_MULTIFUNCTION) ? 8 : 1;
+
+      for (unsigned fn = 0; fn < functions; fn++) {
+        f.function = fn;
+
+        if (f.read16(PCI_VENDOR_ID) == vendor and f.read16(PCI_DEVICE_ID) == device) {
+          found = f;
+          return true;
+        }
+      }
+    }
+  }
+
+  return false;
+}
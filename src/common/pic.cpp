@@ -0,0 +1,114 @@
+#include "arch.hpp"
+#include "pic.hpp"
+#include "util.hpp"
+#include "x86.hpp"
+
+namespace {
+
+enum : uint16_t {
+  PIC_MASTER_CMD = 0x20,
+  PIC_MASTER_DATA = 0x21,
+  PIC_SLAVE_CMD = 0xA0,
+  PIC_SLAVE_DATA = 0xA1,
+};
+
+enum : uint8_t {
+  ICW1_INIT = 0x10,
+  ICW1_ICW4 = 0x01,
+  ICW4_8086 = 0x01,
+
+  OCW2_EOI = 0x20,
+  OCW3_READ_ISR = 0x0B,
+
+  // The IRQ of the master that the slave is connected to.
+  CASCADE_IRQ = 2,
+};
+
+}
+
+static void (*irq_handlers[pic_irq_count])();
+
+static bool pic_ready = false;
+
+// Old PICs need time between accesses. Port 0x80 is the POST code port, which
+// is safe to write to.
+static void pic_out(uint16_t port, uint8_t value)
+{
+  outb(port, value);
+  outbi<0x80>(0);
+}
+
+// Move the IRQs away from the exception vectors and mask all of them.
+static void setup_pic()
+{
+  pic_out(PIC_MASTER_CMD, ICW1_INIT | ICW1_ICW4);
+  pic_out(PIC_SLAVE_CMD, ICW1_INIT | ICW1_ICW4);
+  pic_out(PIC_MASTER_DATA, pic_vector_base);
+  pic_out(PIC_SLAVE_DATA, pic_vector_base + 8);
+  pic_out(PIC_MASTER_DATA, 1 << CASCADE_IRQ);
+  pic_out(PIC_SLAVE_DATA, CASCADE_IRQ);
+  pic_out(PIC_MASTER_DATA, ICW4_8086);
+  pic_out(PIC_SLAVE_DATA, ICW4_8086);
+
+  pic_out(PIC_MASTER_DATA, 0xFF);
+  pic_out(PIC_SLAVE_DATA, 0xFF);
+
+  route_pic_interrupts();
+  pic_ready = true;
+}
+
+static void unmask_irq(size_t irq)
+{
+  if (irq >= 8) {
+    pic_out(PIC_SLAVE_DATA, inb(PIC_SLAVE_DATA) & ~(1 << (irq - 8)));
+    irq = CASCADE_IRQ;
+  }
+
+  pic_out(PIC_MASTER_DATA, inb(PIC_MASTER_DATA) & ~(1 << irq));
+}
+
+void set_irq_handler(size_t irq, void (*handler)())
+{
+  assert(irq < pic_irq_count, "IRQ out of range");
+
+  if (not pic_ready)
+    setup_pic();
+
+  irq_handlers[irq] = handler;
+  unmask_irq(irq);
+}
+
+// A PIC reports its lowest priority IRQ, when the IRQ goes away before the CPU
+// takes it. The in-service register tells the real IRQ from such a spurious
+// one.
+static bool is_spurious(size_t irq)
+{
+  if (irq % 8 != 7)
+    return false;
+
+  uint16_t const cmd = irq >= 8 ? PIC_SLAVE_CMD : PIC_MASTER_CMD;
+
+  outb(cmd, OCW3_READ_ISR);
+  return not (inb(cmd) & 0x80);
+}
+
+void handle_irq(size_t irq)
+{
+  assert(irq < pic_irq_count, "IRQ out of range");
+
+  // A spurious IRQ is not in service, so it takes no EOI. For a spurious IRQ
+  // of the slave, the master still has the cascade in service.
+  if (is_spurious(irq)) {
+    if (irq >= 8)
+      outb(PIC_MASTER_CMD, OCW2_EOI);
+    return;
+  }
+
+  if (irq_handlers[irq])
+    irq_handlers[irq]();
+
+  if (irq >= 8)
+    outb(PIC_SLAVE_CMD, OCW2_EOI);
+
+  outb(PIC_MASTER_CMD, OCW2_EOI);
+}
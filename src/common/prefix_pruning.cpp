@@ -0,0 +1,128 @@
+#include <cstring>
+
+#include "arch.hpp"
+#include "prefix_pruning.hpp"
+#include "util.hpp"
+
+// The bytes after the opcode that we compare prefixed and unprefixed opcodes
+// with. They cover ModRM bytes with a register, a SIB byte and displacements,
+// and two values of reg. All other bytes are zero.
+static const uint8_t probe_tails[] { 0x00, 0x04, 0x05, 0x80, 0xC0, 0xF8 };
+
+// The execution attempts of an unprefixed opcode with the probe tails.
+struct opcode_summary {
+  bool known = false;
+  execution_attempt attempts[array_size(probe_tails)];
+};
+
+// One summary for every opcode in the one-byte, 0F, 0F 38 and 0F 3A maps.
+static opcode_summary cpu_summaries[max_cpus][4][256];
+static cache_line_aligned<uint64_t> cpu_pruned[max_cpus];
+
+uint64_t get_pruned_opcodes()
+{
+  uint64_t total = 0;
+
+  for (auto const &p : cpu_pruned)
+    total += p.value;
+
+  return total;
+}
+
+// Return the opcode map of the opcode at the start of the bytes and the
+// number of bytes of the opcode.
+static size_t opcode_map(uint8_t const *opcode, size_t &length)
+{
+  if (opcode[0] != 0x0F) {
+    length = 1;
+    return 0;
+  }
+
+  if (opcode[1] == 0x38 or opcode[1] == 0x3A) {
+    length = 3;
+    return opcode[1] == 0x38 ? 2 : 3;
+  }
+
+  length = 2;
+  return 1;
+}
+
+// Returns true, if the first length bytes of a and b are the same.
+static bool same_start(instruction_bytes const &a, instruction_bytes const &b, size_t length)
+{
+  for (size_t i = 0; i < length; i++) {
+    if (a.raw[i] != b.raw[i])
+      return false;
+  }
+
+  return true;
+}
+
+void prefix_pruning::log_skipped(instruction_bytes const &candidate, size_t prefixes)
+{
+  if (log_count_ and (log_length_ != prefixes or not same_start(log_prefixes_, candidate, prefixes)))
+    flush_log();
+
+  log_prefixes_ = candidate;
+  log_length_ = prefixes;
+  log_count_++;
+}
+
+void prefix_pruning::flush_log()
+{
+  if (not log_count_)
+    return;
+
+  format(">>> Skipped ", log_count_, " opcode", log_count_ == 1 ? "" : "s", " after prefixes");
+  for (size_t i = 0; i < log_length_; i++)
+    format(" ", hex(log_prefixes_.raw[i], 2, false));
+  format(", which behave like without them.\n");
+
+  log_count_ = 0;
+}
+
+bool prefix_pruning::is_redundant(instruction_bytes const &candidate, size_t pos, size_t prefixes)
+{
+  if (prefixes == 0 or prefixes + 3 > sizeof(candidate.raw))
+    return false;
+
+  // Only look at the first candidate of each opcode.
+  size_t length;
+  size_t const map = opcode_map(candidate.raw + prefixes, length);
+
+  if (pos + 1 != prefixes + length)
+    return false;
+
+  auto &summary = cpu_summaries[cpu_index()][map][candidate.raw[pos]];
+  instruction_bytes probed {};
+
+  if (not summary.known) {
+    memcpy(probed.raw, candidate.raw + prefixes, length);
+    for (size_t i = 0; i < array_size(probe_tails); i++) {
+      probed.raw[length] = probe_tails[i];
+      summary.attempts[i] = find_instruction_length(features_, mode_, probed);
+    }
+
+    summary.known = true;
+  }
+
+  // An opcode without anything after it has no subtree to skip.
+  if (summary.attempts[0].length <= length)
+    return false;
+
+  memcpy(probed.raw, candidate.raw, prefixes + length);
+  for (size_t i = 0; i < array_size(probe_tails); i++) {
+    probed.raw[prefixes + length] = probe_tails[i];
+
+    auto const attempt = find_instruction_length(features_, mode_, probed);
+    auto const &unprefixed = summary.attempts[i];
+
+    if (attempt.exception != unprefixed.exception or attempt.length != unprefixed.length + prefixes)
+      return false;
+  }
+
+  cpu_pruned[cpu_index()].value++;
+  log_skipped(candidate, prefixes);
+
+  return true;
+}
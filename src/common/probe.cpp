@@ -0,0 +1,254 @@
+#include <cstring>
+
+#include "arch.hpp"
+#include "cpu_features.hpp"
+#include "probe.hpp"
+#include "util.hpp"
+#include "x86.hpp"
+
+static cache_line_aligned<probe_statistics> cpu_stats[max_cpus];
+
+probe_statistics const &get_probe_statistics()
+{
+  static probe_statistics total;
+
+  total = {};
+  for (auto const &c : cpu_stats) {
+    auto const &s = c.value;
+    total.executions += s.executions;
+    total.skipped_executions += s.skipped_executions;
+    total.inferred += s.inferred;
+  }
+
+  return total;
+}
+
+// The user space address where an instruction of the given length starts, if
+// it ends right at the end of the given user page.
+static uintptr_t truncated_ip(size_t length, size_t page = 0)
+{
+  return get_user_page(page) + page_size - length;
+}
+
+// Place the first length bytes of the instruction right before the end of the
+// given user page. Returns the user space address of the instruction.
+static uintptr_t place_truncated(instruction_bytes const &instr, size_t length,
+                                 size_t page = 0)
+{
+  memcpy(get_user_page_backing(page) + page_size - length, instr.raw, length);
+  return truncated_ip(length, page);
+}
+
+// Check whether executing an instruction that was placed with
+// place_truncated() resulted in an incomplete instruction fetch.
+static bool is_incomplete_fetch(cpu_features const &features,
+                                user_exception const &exc,
+                                size_t length, size_t page = 0)
+{
+  // The instruction hasn't been completely fetched, if we get an instruction
+  // fetch page fault from userspace.
+  //
+  // The check for RIP is necessary, because otherwise we cannot correctly
+  // guess the length of XBEGIN with an abort address following the XBEGIN
+  // instruction.
+
+  mword_t const pt_exc_instr = features.has_nx ? EXC_PF_ERR_I : 0;
+  mword_t const pt_exc_mask = EXC_PF_ERR_P | EXC_PF_ERR_U | pt_exc_instr;
+  mword_t const pt_exc_expect = EXC_PF_ERR_U | pt_exc_instr;
+
+  return exc.vector == 14 and
+    (exc.error_code & pt_exc_mask) == pt_exc_expect and
+    exc.cr2 == get_user_page(page) + page_size and
+    exc.ip == truncated_ip(length, page);
+}
+
+// Place the first length bytes of the instruction right before the end of the
+// user page and execute them. Returns true, if the instruction could not be
+// completely fetched, i.e. it is longer than length bytes.
+static bool execute_truncated(cpu_features const &features,
+                              instruction_bytes const &instr, size_t length,
+                              exception_frame &ef)
+{
+  ef = execute_user(place_truncated(instr, length));
+  cpu_stats[cpu_index()].value.executions++;
+
+  return is_incomplete_fetch(features, { ef.vector, ef.error_code, get_cr2(), ef.ip },
+                             length);
+}
+
+static execution_attempt find_instruction_length_linear(cpu_features const &features,
+                                                        instruction_bytes const &instr,
+                                                        size_t known_incomplete)
+{
+  exception_frame ef {};
+  size_t i;
+
+  // If every length is already known to be incomplete, we report the
+  // instruction fetch page fault that we would have seen.
+  ef.vector = 14;
+
+  for (i = known_incomplete + 1; i <= array_size(instr.raw); i++) {
+    if (not execute_truncated(features, instr, i, ef))
+      break;
+  }
+
+  return { (uint8_t)i, (uint8_t)ef.vector };
+}
+
+// Whether the instruction fetch is incomplete only depends on whether we placed
+// fewer bytes than the instruction is long. So we can binary search for the
+// shortest length that is completely fetched. This needs at most 4 executions
+// instead of up to 15.
+static execution_attempt find_instruction_length_binary(cpu_features const &features,
+                                                        instruction_bytes const &instr,
+                                                        size_t known_incomplete)
+{
+  size_t lo = known_incomplete + 1;
+  size_t hi = array_size(instr.raw) + 1;
+
+  // If the instruction is never completely fetched, we report the instruction
+  // fetch page fault just like the linear search.
+  uint8_t exception = 14;
+
+  // If we know that a prefix is incomplete, the candidate most likely differs
+  // from the previous one only in its last byte. So try the next length first.
+  bool try_lo_first = known_incomplete > 0;
+
+  while (lo < hi) {
+    size_t const mid = try_lo_first ? lo : lo + (hi - lo) / 2;
+    exception_frame ef;
+
+    try_lo_first = false;
+
+    if (execute_truncated(features, instr, mid, ef)) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+      exception = (uint8_t)ef.vector;
+    }
+  }
+
+  return { (uint8_t)hi, exception };
+}
+
+// Execute every length that is not known to be incomplete in one batch. Each
+// length gets its own user page. This is the same search as the linear one, but
+// we only come back to C++ code once all lengths are executed.
+static execution_attempt find_instruction_length_batch(cpu_features const &features,
+                                                       instruction_bytes const &instr,
+                                                       size_t known_incomplete)
+{
+  static_assert(sizeof(instr.raw) <= user_page_count, "Not enough user pages for a batch");
+
+  uintptr_t ips[sizeof(instr.raw)] {};
+  user_exception results[sizeof(instr.raw)];
+  size_t count = 0;
+
+  for (size_t length = known_incomplete + 1; length <= sizeof(instr.raw); length++, count++)
+    ips[count] = place_truncated(instr, length, count);
+
+  execute_user_batch(ips, results, count);
+  cpu_stats[cpu_index()].value.executions += count;
+
+  for (size_t i = 0; i < count; i++) {
+    size_t const length = known_incomplete + 1 + i;
+
+    if (not is_incomplete_fetch(features, results[i], length, i))
+      return { (uint8_t)length, (uint8_t)results[i].vector };
+  }
+
+  // Every length was incomplete, see find_instruction_length_linear.
+  return { (uint8_t)(sizeof(instr.raw) + 1), 14 };
+}
+
+// If an instruction executes without faulting, the single-step trap reports
+// the address of the next instruction and thus gives us the length. This is
+// wrong for control transfers, so we confirm the length by checking that it
+// is the shortest completely fetched length.
+static execution_attempt find_instruction_length_infer(cpu_features const &features,
+                                                       instruction_bytes const &instr,
+                                                       size_t known_incomplete)
+{
+  size_t const max_length = array_size(instr.raw);
+  exception_frame ef;
+
+  if (execute_truncated(features, instr, max_length, ef) or ef.vector != 1)
+    return find_instruction_length_binary(features, instr, known_incomplete);
+
+  mword_t const delta = ef.ip - truncated_ip(max_length);
+
+  if (delta <= known_incomplete or delta > max_length)
+    return find_instruction_length_binary(features, instr, known_incomplete);
+
+  if (delta - 1 > known_incomplete) {
+    if (not execute_truncated(features, instr, delta - 1, ef))
+      return find_instruction_length_binary(features, instr, known_incomplete);
+
+    known_incomplete = delta - 1;
+  }
+
+  if (execute_truncated(features, instr, delta, ef))
+    return find_instruction_length_binary(features, instr, delta);
+
+  cpu_stats[cpu_index()].value.inferred++;
+  return { (uint8_t)delta, (uint8_t)ef.vector };
+}
+
+static void print_mismatch(instruction_bytes const &instr, const char *mode,
+                           execution_attempt const &expected,
+                           execution_attempt const &got)
+{
+  format("!!! Probe mismatch:");
+  for (size_t i = 0; i < expected.length and i < array_size(instr.raw); i++) {
+    format(" ", hex(instr.raw[i], 2, false));
+  }
+
+  format(" is ", expected.length, " bytes with exception ",
+         hex(expected.exception, 2, false), ", but ", mode, " found ",
+         got.length, " bytes with exception ", hex(got.exception, 2, false), "\n");
+}
+
+execution_attempt find_instruction_length(cpu_features const &features,
+                                          probe_mode mode,
+                                          instruction_bytes const &instr,
+                                          size_t known_incomplete)
+{
+  cpu_stats[cpu_index()].value.skipped_executions += known_incomplete;
+
+  switch (mode) {
+  case probe_mode::linear:
+    return find_instruction_length_linear(features, instr, known_incomplete);
+  case probe_mode::binary:
+    return find_instruction_length_binary(features, instr, known_incomplete);
+  case probe_mode::infer:
+    return find_instruction_length_infer(features, instr, known_incomplete);
+  case probe_mode::batch:
+    return find_instruction_length_batch(features, instr, known_incomplete);
+  case probe_mode::verify:
+    break;
+  }
+
+  auto const linear = find_instruction_length_linear(features, instr, known_incomplete);
+  auto const binary = find_instruction_length_binary(features, instr, known_incomplete);
+  auto const infer = find_instruction_length_infer(features, instr, known_incomplete);
+
+  if (linear != binary)
+    print_mismatch(instr, "binary search", linear, binary);
+
+  if (linear != infer)
+    print_mismatch(instr, "inference", linear, infer);
+
+  // The batch runs with all user pages mapped. Memory operands on them don't
+  // fault there, so compare it to a linear search that sees the same pages.
+  map_user_pages();
+
+  auto const linear_mapped = find_instruction_length_linear(features, instr, known_incomplete);
+  auto const batch = find_instruction_length_batch(features, instr, known_incomplete);
+
+  unmap_user_pages();
+
+  if (linear_mapped != batch)
+    print_mismatch(instr, "batched search", linear_mapped, batch);
+
+  return linear;
+}
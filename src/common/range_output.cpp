@@ -0,0 +1,95 @@
+#include "arch.hpp"
+#include "range_output.hpp"
+#include "util.hpp"
+
+namespace {
+
+struct alignas(cache_line_size) held_range {
+  // The first instruction of the range.
+  instruction_bytes instr;
+  execution_attempt attempt;
+
+  // The last byte of the last instruction in the range.
+  uint8_t last = 0;
+
+  bool held = false;
+};
+
+}
+
+static held_range held_ranges[max_cpus];
+
+// print() flushes ranges before printing. Until there are any, this keeps it
+// from looking at the current CPU, which doesn't work before paging is set up.
+static bool have_ranges = false;
+
+// How many bytes of an instruction are printed.
+static size_t printed_length(execution_attempt const &attempt)
+{
+  return attempt.length < sizeof(instruction_bytes::raw) ? attempt.length : sizeof(instruction_bytes::raw);
+}
+
+// Can the instruction extend the range?
+static bool continues(held_range const &range, instruction_bytes const &instr,
+                      execution_attempt const &attempt)
+{
+  size_t const length = attempt.length;
+
+  if (not range.held or range.attempt != attempt or length == 0 or length >= sizeof(instr.raw))
+    return false;
+
+  for (size_t i = 0; i + 1 < length; i++)
+    if (range.instr.raw[i] != instr.raw[i])
+      return false;
+
+  return range.last != 0xFF and instr.raw[length - 1] == range.last + 1;
+}
+
+void flush_ranges()
+{
+  if (not have_ranges)
+    return;
+
+  auto &range = held_ranges[cpu_index()];
+
+  if (not range.held)
+    return;
+
+  // Printing flushes ranges as well.
+  range.held = false;
+
+  auto const &instr = range.instr;
+  size_t const printed = printed_length(range.attempt);
+  bool const is_range = printed > 0 and range.last != instr.raw[printed - 1];
+
+  format("EXC ", hex(range.attempt.exception, 2, false), " ",
+         range.attempt.length >= sizeof(instr.raw) ? "??" : "OK", " |");
+
+  for (size_t i = 0; i < printed; i++) {
+    if (is_range and i + 1 == printed)
+      format(" [", hex(instr.raw[i], 2, false), "-", hex(range.last, 2, false), "]");
+    else
+      format(" ", hex(instr.raw[i], 2, false));
+  }
+
+  format("\n");
+}
+
+void print_range(instruction_bytes const &instr, execution_attempt const &attempt)
+{
+  have_ranges = true;
+
+  auto &range = held_ranges[cpu_index()];
+
+  if (continues(range, instr, attempt)) {
+    range.last++;
+    return;
+  }
+
+  flush_ranges();
+
+  range.instr = instr;
+  range.attempt = attempt;
+  range.last = printed_length(attempt) > 0 ? instr.raw[printed_length(attempt) - 1] : 0;
+  range.held = true;
+}
@@ -0,0 +1,82 @@
+#include <cstdint>
+
+#include "arch.hpp"
+#include "record_output.hpp"
+#include "util.hpp"
+
+namespace {
+
+struct alignas(cache_line_size) record_block {
+  // The 00 and the number of records, the records and the checksum.
+  uint8_t data[2 + 64 * (2 + sizeof(instruction_bytes::raw)) + 2];
+  size_t length = 0;
+  size_t count = 0;
+};
+
+}
+
+static record_block record_blocks[max_cpus];
+
+// print() flushes records before printing. Until there are any, this keeps it
+// from looking at the current CPU, which doesn't work before paging is set up.
+static bool have_records = false;
+
+// Leave room for the checksum.
+const size_t max_record_data = sizeof(record_block::data) - 2;
+
+// The number of records has to fit into a byte. Blocks of short records reach
+// this before they are full.
+const size_t max_records = 255;
+
+void flush_records()
+{
+  if (not have_records)
+    return;
+
+  auto &block = record_blocks[cpu_index()];
+
+  if (block.count == 0)
+    return;
+
+  uint32_t sum1 = 0, sum2 = 0;
+
+  block.data[0] = 0x00;
+  block.data[1] = block.count;
+
+  for (size_t i = 1; i < block.length; i++) {
+    sum1 = (sum1 + block.data[i]) % 255;
+    sum2 = (sum2 + sum1) % 255;
+  }
+
+  block.data[block.length++] = sum1;
+  block.data[block.length++] = sum2;
+
+  write_output(reinterpret_cast<const char *>(block.data), block.length);
+
+  block.length = 0;
+  block.count = 0;
+}
+
+void print_record(instruction_bytes const &instr, execution_attempt const &attempt)
+{
+  have_records = true;
+
+  auto &block = record_blocks[cpu_index()];
+  size_t const length = attempt.length < sizeof(instr.raw) ? attempt.length : sizeof(instr.raw);
+  bool const escaped = attempt.exception >= 0xF;
+
+  if (block.count == max_records or block.length + 2 + length > max_record_data)
+    flush_records();
+
+  if (block.count == 0)
+    block.length = 2;
+
+  block.data[block.length++] = (escaped ? 0xF0 : attempt.exception << 4) | length;
+  if (escaped)
+    block.data[block.length++] = attempt.exception;
+
+  for (size_t i = 0; i < length; i++)
+    block.data[block.length++] = instr.raw[i];
+
+  block.count++;
+}
@@ -4,169 +4,462 @@
 #include "search.hpp"
 #include "util.hpp"
 
-static constexpr int opcode_to_prefix_group(uint8_t byte, size_t detect_prefixes_)
+template <int PREFIXES>
+basic_search_engine<PREFIXES>::basic_search_engine(size_t max_prefixes, size_t used_prefixes,
+                                                   size_t detect_prefixes, search_range const &range)
+  : current_(range.start), end_(range.end), has_end_(not is_zero(range.end)),
+    prefixes_(max_prefixes, used_prefixes, detect_prefixes)
+{}
+
+template <int PREFIXES>
+bool basic_search_engine<PREFIXES>::are_acceptable_from(size_t pos, int last_group, size_t count) const
 {
-  int group = -1;
+  auto const &automaton = prefixes_.automaton();
 
-  switch (byte) {
-  case 0xF0:                    // LOCK
-  case 0xF2:                    // REPNE
-  case 0xF3:                    // REP
-    if (detect_prefixes_ & (1<<0)) //To detect?
-    {
-      group = 0;
-    }
-    break;
-  case 0x2E:                    // CS
-  case 0x36:                    // SS
-  case 0x3e:                    // DS
-  case 0x26:                    // ES
-  case 0x64:                    // FS
-  case 0x65:                    // GS
-    if (detect_prefixes_ & (1<<1)) //To detect?
-    {
-      group = 1;
-    }
-    break;
-  case 0x66:                    // operand size override
-    if (detect_prefixes_ & (1<<2)) //To detect?
-    {
-      group = 2;
-    }
-    break;
-  case 0x67:                    // address size override
-    if (detect_prefixes_ & (1<<3)) //To detect?
-    {
-      group = 3;
-    }
-    break;
-  case 0x40 ... 0x4F:           // REX prefixes
-    if (detect_prefixes_ & (1<<4)) //To detect?
-    {
-      group = 4;
-    }
-    break;
+  for (; pos < sizeof(current_.raw); pos++) {
+    uint8_t const byte = current_.raw[pos];
+    auto const &next = automaton.next_acceptable[automaton.state(last_group, count < prefixes_.max_prefixes())];
+
+    if (next[byte] != byte)
+      return false;
+
+    int group = automaton.group_lut.data[byte];
+    if (group < 0)
+      return true;
+
+    last_group = group;
+    count++;
   }
 
-  return group;
+  // Nothing but prefixes.
+  return false;
 }
 
-prefix_group_lut::prefix_group_lut(size_t detect_prefixes_)
+template <int PREFIXES>
+bool basic_search_engine<PREFIXES>::is_after_end() const
 {
-  for (size_t i = 0; i < array_size(data); i++) {
-    data[i] = (int8_t)opcode_to_prefix_group((uint8_t)i,detect_prefixes_);
-  }
+  return has_end_ and not is_before(current_, end_);
+}
+
+template <int PREFIXES>
+size_t basic_search_engine<PREFIXES>::prefix_length() const
+{
+  auto const &group_lut = prefixes_.automaton().group_lut;
+  size_t length = 0;
+
+  while (length < sizeof(current_.raw) and group_lut.data[current_.raw[length]] >= 0)
+    length++;
+
+  return length;
+}
+
+template <int PREFIXES>
+void basic_search_engine<PREFIXES>::clear_after(size_t pos)
+{
+  if (pos < sizeof(current_.raw))
+    memset(current_.raw + pos, 0, sizeof(current_.raw) - pos);
+}
+
+template <int PREFIXES>
+void basic_search_engine<PREFIXES>::start_over(size_t length)
+{
+  increment_at_ = length - 1;
 }
 
-// Encapsulates which prefixes are there, where and how many there are.
-struct prefix_state {
-  uint8_t count[5] {};          // Count of prefixes in each group.
-  uint8_t position[5] {};       // Position of each prefix (tracked per group)
+template <int PREFIXES>
+bool basic_search_engine<PREFIXES>::find_next_candidate()
+{
+  auto const &automaton = prefixes_.automaton();
+  size_t const max_prefixes = prefixes_.max_prefixes();
 
-  size_t total_prefix_bytes() const
-  {
-    size_t sum = 0;
+ again:
+  // Run the prefix automaton up to the byte we increment. The bytes in front
+  // of it are unchanged from a valid candidate, so there is an opcode byte
+  // after at most max_prefixes prefixes.
+  int last_group = -1;
+  size_t count = 0;
+  bool in_prefixes = true;
 
-    for (auto c : count) {
-      sum += c;
+  for (size_t i = 0; i < increment_at_ and i <= max_prefixes; i++) {
+    int group = automaton.group_lut.data[current_.raw[i]];
+
+    if (group < 0) {
+      in_prefixes = false;
+      break;
     }
 
-    return sum;
+    last_group = group;
+    count++;
   }
 
-  bool has_duplicated_prefixes() const
-  {
-    for (auto c : count) {
-      if (c >= 2)
-        return true;
+  uint8_t &byte = current_.raw[increment_at_];
+  uint8_t next = byte + 1;
+
+  // Skip all bytes that can't be a prefix here.
+  if (in_prefixes and next != 0)
+    next = automaton.next_acceptable[automaton.state(last_group, count < max_prefixes)][next];
+
+  byte = next;
+
+  if (byte == 0) {
+    // We've wrapped at our current position, so go left one byte. If we hit
+    // the beginning, we are done.
+    if (unlikely(increment_at_-- == 0)) {
+      return false;
     }
-    
-    return false;
+
+    goto again;
   }
 
-  bool has_unused_prefixes(size_t used_prefixes_) const
-  {
-    //Detect used_prefixes and filter them out.
-      size_t b = 1;
-      for (size_t i = 0; i < array_size(count); i++, b <<= 1)
-      {
-          if (count[i] and ((used_prefixes_ & b) == 0)) //Prefix not to be used?
-              return true;
-      }
-    
+  // Candidates only ever grow, so we are done once we reach the end.
+  if (is_after_end())
     return false;
+
+  // The bytes after the one we incremented might still be prefixes that don't
+  // fit anymore.
+  if (in_prefixes and not are_acceptable_from(increment_at_, last_group, count))
+    goto again;
+
+  return true;
+}
+
+template <int PREFIXES>
+bool basic_search_engine<PREFIXES>::find_first_candidate()
+{
+  auto const &automaton = prefixes_.automaton();
+  int last_group = -1;
+  size_t count = 0;
+
+  if (is_after_end())
+    return false;
+
+  for (size_t pos = 0; pos < sizeof(current_.raw); pos++) {
+    uint8_t const byte = current_.raw[pos];
+    auto const &next = automaton.next_acceptable[automaton.state(last_group, count < prefixes_.max_prefixes())];
+
+    if (next[byte] != byte) {
+      // Continue with the smallest acceptable byte after this one. Zero is
+      // always acceptable, so the byte is not zero. If no byte after it is
+      // acceptable, find_next_candidate() goes to the byte in front of it.
+      current_.raw[pos] = byte - 1;
+      clear_after(pos + 1);
+      increment_at_ = pos;
+
+      return find_next_candidate();
+    }
+
+    int group = automaton.group_lut.data[byte];
+    if (group < 0)
+      return true;
+
+    last_group = group;
+    count++;
   }
 
-  // We assume no duplicated prefixes here.
-  bool has_ordered_prefixes() const
-  {
-    // TODO There has to be a better way to express this. This also generates an
-    // amazing number of conditional jumps with clang. Maybe use non-short-circuit
-    // boolean operators.
-    for (size_t i = 0; i < array_size(position) - 1; i++)
-      for (size_t j = i + 1; j < array_size(position); j++)
-        // Use non-short-circuit operators to reduce the number of conditional
-        // jumps.
-        if (count[i] and count[j] and (position[i] > position[j]))
-          return false;
+  // Nothing but prefixes. Continue after them.
+  increment_at_ = sizeof(current_.raw) - 1;
+  return find_next_candidate();
+}
+
+// The specializations that sift() picks from. See has_specialized_search.
+template class basic_search_engine<configured_prefixes>;
+template class basic_search_engine<0>;
+template class basic_search_engine<1>;
+template class basic_search_engine<2>;
+
+// Return a mask that makes all bits random, if the given one is all zeroes.
+static instruction_bytes random_mask(instruction_bytes const &mask)
+{
+  if (not is_zero(mask))
+    return mask;
+
+  instruction_bytes all;
+
+  for (auto &b : all.raw)
+    b = 0xFF;
+
+  return all;
+}
+
+template <int PREFIXES>
+basic_random_search<PREFIXES>::basic_random_search(uint64_t seed, size_t max_prefixes, size_t used_prefixes,
+                                                   size_t detect_prefixes, instruction_bytes const &fixed,
+                                                   instruction_bytes const &mask)
+  : fixed_(fixed), mask_(random_mask(mask)), prefixes_(max_prefixes, used_prefixes, detect_prefixes)
+{
+  // splitmix64 spreads similar seeds apart. xorshift must not start at zero.
+  uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z ^= z >> 31;
+  state_ = z ? z : 1;
+
+  // Collect the prefixes that may start a sequence. Prefixes that are not used
+  // are never acceptable.
+  auto const &automaton = prefixes_.automaton();
+  auto const &first = automaton.next_acceptable[automaton.state(-1, true)];
+
+  for (size_t byte = 1; byte < array_size(first); byte++) {
+    int const group = automaton.group_lut.data[byte];
+
+    if (group >= 0 and first[byte] == byte and group_size_[group] < array_size(group_bytes_[group]))
+      group_bytes_[group][group_size_[group]++] = byte;
+  }
+
+  for (auto size : group_size_) {
+    if (size)
+      used_groups_++;
+  }
+}
+
+template <int PREFIXES>
+uint64_t basic_random_search<PREFIXES>::next_random()
+{
+  // xorshift64*
+  state_ ^= state_ >> 12;
+  state_ ^= state_ << 25;
+  state_ ^= state_ >> 27;
+
+  return state_ * 0x2545F4914F6CDD1DULL;
+}
+
+template <int PREFIXES>
+size_t basic_random_search<PREFIXES>::random_below(size_t n)
+{
+  // The high bits of xorshift64* are the good ones. Only use 32 of them, so
+  // x86_32 doesn't need a 64-bit division.
+  return (uint32_t)(next_random() >> 32) % n;
+}
+
+template <int PREFIXES>
+uint8_t basic_random_search<PREFIXES>::random_byte(size_t pos)
+{
+  return (fixed_.raw[pos] & ~mask_.raw[pos]) | ((uint8_t)(next_random() >> 56) & mask_.raw[pos]);
+}
 
-    return true;
+template <int PREFIXES>
+instruction_bytes const &basic_random_search<PREFIXES>::next_candidate()
+{
+  auto const &group_lut = prefixes_.automaton().group_lut;
+  size_t const max_prefixes = prefixes_.max_prefixes();
+
+  // Prefixes come in the order of their groups and there is at most one of
+  // each group. See prefix_automaton. So pick a random set of groups of the
+  // right size and then a random prefix of each group.
+  size_t const room = max_prefixes < used_groups_ ? max_prefixes : used_groups_;
+  size_t wanted = random_below(room + 1);
+  size_t left = used_groups_;
+  size_t count = 0;
+
+  for (size_t group = 0; group < array_size(group_size_) and wanted > 0; group++) {
+    if (group_size_[group] == 0)
+      continue;
+
+    if (random_below(left--) < wanted) {
+      current_.raw[count++] = group_bytes_[group][random_below(group_size_[group])];
+      wanted--;
+    }
   }
-};
 
-static prefix_state analyze_prefixes(prefix_group_lut const &group_lut_, instruction_bytes const &instr)
+  for (size_t i = count; i < sizeof(current_.raw); i++)
+    current_.raw[i] = random_byte(i - count);
+
+  // The opcode must not be another prefix. The fixed bits may not leave a
+  // choice, so also give up on this after a few tries.
+  for (size_t tries = 0; tries < 16 and group_lut.data[current_.raw[count]] >= 0; tries++)
+    current_.raw[count] = random_byte(0);
+
+  return current_;
+}
+
+// The specializations that sift() picks from. See has_specialized_search.
+template class basic_random_search<configured_prefixes>;
+template class basic_random_search<0>;
+template class basic_random_search<1>;
+template class basic_random_search<2>;
+
+namespace {
+
+// The opcodes after the escape bytes 0F, 0F 38 and 0F 3A are from opcode maps
+// of their own. An opcode weighs the same, no matter which map it is from.
+const uint64_t three_byte_map_work = 256;
+const uint64_t two_byte_map_work = 256 - 2 + 2 * three_byte_map_work;
+
+bool is_three_byte_escape(uint8_t byte)
+{
+  return byte == 0x38 or byte == 0x3A;
+}
+
+}
+
+// The work below the bytes from the opcode at pos up to length. Sets divisible,
+// if these are escape bytes that can be split further.
+static uint64_t work_below_opcode(instruction_bytes const &candidate, size_t pos, size_t length,
+                                  bool &divisible)
 {
-  prefix_state state;
+  uint8_t const *opcode = candidate.raw + pos;
+  size_t const opcode_length = length - pos;
+
+  divisible = false;
+
+  if (opcode[0] != 0x0F)
+    return 1;
+
+  if (opcode_length == 1) {
+    divisible = length < sizeof(candidate.raw);
+    return two_byte_map_work;
+  }
+
+  if (not is_three_byte_escape(opcode[1]))
+    return 1;
+
+  if (opcode_length == 2) {
+    divisible = length < sizeof(candidate.raw);
+    return three_byte_map_work;
+  }
+
+  return 1;
+}
 
-  for (size_t i = 0; i < sizeof(instr.raw); i++) {
-    int group = group_lut_.data[instr.raw[i]];
+search_estimate::search_estimate(size_t max_prefixes, size_t used_prefixes, size_t detect_prefixes)
+  : max_prefixes_(max_prefixes), used_prefixes_(used_prefixes), group_lut_(detect_prefixes)
+{
+  for (auto group : group_lut_.data) {
     if (group < 0)
-      break;
+      opcodes_++;
+    else
+      group_size_[group]++;
+  }
+}
 
-    state.count[group]++;
-    state.position[group] = i;
+uint64_t search_estimate::work_after_prefixes(size_t count, int last_group) const
+{
+  // 0F is never a prefix. It has all the escape maps below it.
+  uint64_t work = opcodes_ - 1 + two_byte_map_work;
+
+  // Prefixes follow each other in the order of their groups. See
+  // prefix_automaton.
+  if (count < max_prefixes_) {
+    for (int group = last_group + 1; group < (int)array_size(group_size_); group++) {
+      if (used_prefixes_ & (1 << group))
+        work += group_size_[group] * work_after_prefixes(count + 1, group);
+    }
   }
 
-  return state;
+  return work;
 }
 
-void search_engine::clear_after(size_t pos)
+uint64_t search_estimate::work_below(instruction_bytes const &candidate, size_t length,
+                                     bool &divisible) const
 {
-  if (pos < sizeof(current_.raw))
-    memset(current_.raw + pos, 0, sizeof(current_.raw) - pos);
+  size_t count = 0;
+  int last_group = -1;
+
+  divisible = false;
+
+  for (size_t i = 0; i < length; i++) {
+    int group = group_lut_.data[candidate.raw[i]];
+
+    if (group < 0)
+      return work_below_opcode(candidate, i, length, divisible);
+
+    // The search skips this candidate. See prefix_automaton.
+    if (group <= last_group or count >= max_prefixes_ or not (used_prefixes_ & (1 << group)))
+      return 0;
+
+    count++;
+    last_group = group;
+  }
+
+  divisible = length < sizeof(candidate.raw);
+  return work_after_prefixes(count, last_group);
 }
 
-void search_engine::start_over(size_t length)
+uint64_t search_estimate::work_before(instruction_bytes const &candidate) const
 {
-  increment_at_ = length - 1;
+  instruction_bytes prefix {};
+  uint64_t work = 0;
+
+  for (size_t i = 0; i < sizeof(candidate.raw); i++) {
+    bool divisible;
+
+    for (prefix.raw[i] = 0; prefix.raw[i] < candidate.raw[i]; prefix.raw[i]++)
+      work += work_below(prefix, i + 1, divisible);
+
+    work_below(prefix, i + 1, divisible);
+    if (not divisible)
+      break;
+  }
+
+  return work;
 }
 
-bool search_engine::find_next_candidate()
+instruction_bytes search_estimate::find_boundary(uint64_t work) const
 {
- again:
-  current_.raw[increment_at_]++;
+  instruction_bytes boundary {};
 
-  if (current_.raw[increment_at_] == 0) {
-    // We've wrapped at our current position, so go left one byte. If we hit
-    // the beginning, we are done.
-    if (unlikely(increment_at_-- == 0)) {
-      return false;
+  for (size_t i = 0; i < sizeof(boundary.raw); i++) {
+    size_t b = 0;
+    bool divisible = false;
+
+    for (; b < 0x100; b++) {
+      boundary.raw[i] = b;
+
+      uint64_t const below = work_below(boundary, i + 1, divisible);
+      if (work < below)
+        break;
+
+      work -= below;
     }
 
-    goto again;
+    // There is not that much work.
+    if (b == 0x100)
+      return {};
+
+    if (not divisible or work == 0)
+      break;
   }
 
-  auto const state = analyze_prefixes(group_lut_, current_);
+  return boundary;
+}
 
-  // Duplicated prefixes make the search space explode without generating
-  // insight. Also enforce order on prefixes to further reduce search space.
-  // And also filter out prefixes that are declared not to be used.
-  if (state.total_prefix_bytes() > max_prefixes_ or
-      state.has_duplicated_prefixes() or
-      state.has_unused_prefixes(used_prefixes_) or
-      not state.has_ordered_prefixes()) {
-    goto again;
+search_range search_estimate::split(search_range const &range, size_t part, size_t parts) const
+{
+  assert(part < parts, "Part out of range");
+
+  // Nothing comes before this, so it makes an empty range when used as start
+  // and end.
+  static const instruction_bytes last { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+                                        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+
+  uint64_t const first_work = work_before(range.start);
+  uint64_t const end_work = is_zero(range.end) ? total_work() : work_before(range.end);
+  uint64_t const range_work = end_work > first_work ? end_work - first_work : 0;
+
+  uint64_t const start_work = first_work + range_work * part / parts;
+  uint64_t const stop_work = first_work + range_work * (part + 1) / parts;
+
+  // Small ranges might be within a single unit of work. Then we don't split.
+  if (range_work == 0)
+    return part == 0 ? range : search_range { last, last };
+
+  if (start_work == stop_work)
+    return { last, last };
+
+  search_range res { range.start, range.end };
+
+  if (part > 0) {
+    auto const boundary = find_boundary(start_work);
+    if (is_before(res.start, boundary))
+      res.start = boundary;
   }
 
-  return true;
+  if (part + 1 < parts) {
+    auto const boundary = find_boundary(stop_work);
+    if (is_zero(res.end) or is_before(boundary, res.end))
+      res.end = boundary;
+  }
+
+  return res;
 }
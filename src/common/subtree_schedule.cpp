@@ -0,0 +1,214 @@
+#include <cstdint>
+
+#include "subtree_schedule.hpp"
+#include "util.hpp"
+#include "x86.hpp"
+
+namespace {
+
+struct subtree {
+  work_item work;
+
+  // Executions and interesting candidates of the slices so far. Each slice
+  // halves the ones before it.
+  uint32_t executions = 0;
+  uint32_t found = 0;
+
+  // All candidates of the subtree start with this many fixed bytes. Set by
+  // add_subtrees(). The zero that it starts with keeps the list in .bss.
+  uint8_t depth = 0;
+
+  bool taken = false;
+  bool done = false;
+};
+
+}
+
+// How many subtrees of first bytes we split into the subtrees of their second
+// bytes.
+const size_t max_splits = 64;
+
+static subtree subtrees[256 + max_splits * 256];
+static size_t subtree_count = 0;
+static size_t splits = 0;
+static size_t unfinished = 0;
+
+// All CPUs take subtrees from the same list.
+static bool locked = false;
+
+static void lock()
+{
+  while (__atomic_test_and_set(&locked, __ATOMIC_ACQUIRE))
+    pause();
+}
+
+static void unlock()
+{
+  __atomic_clear(&locked, __ATOMIC_RELEASE);
+}
+
+// Return the first candidate after all candidates that start with the first
+// length bytes of instr. All zeroes means there is none.
+static instruction_bytes after_subtree(instruction_bytes const &instr, size_t length)
+{
+  instruction_bytes res {};
+
+  for (size_t i = 0; i < length; i++)
+    res.raw[i] = instr.raw[i];
+
+  for (size_t i = length; i-- > 0 and ++res.raw[i] == 0;)
+    ;
+
+  return res;
+}
+
+// Add a subtree for every value of the byte at depth - 1 that is in the range
+// of the given work. The first subtree continues the work. The others continue
+// after the first candidate of the subtree in front of them.
+static void add_subtrees(work_item const &first, size_t depth)
+{
+  search_range const &range = first.range;
+  auto const &from = first.resume ? first.position.current : range.start;
+  instruction_bytes start {};
+  instruction_bytes previous {};
+
+  for (size_t i = 0; i < depth; i++)
+    start.raw[i] = from.raw[i];
+
+  for (bool is_first = true;; is_first = false) {
+    assert(subtree_count < array_size(subtrees), "Too many subtrees");
+
+    auto &sub = subtrees[subtree_count++];
+    auto const next = after_subtree(start, depth);
+
+    sub = {};
+    sub.depth = depth;
+
+    if (is_first) {
+      sub.work = first;
+    } else {
+      sub.work.range.start = start;
+      sub.work.resume = true;
+      sub.work.position = { previous, depth - 1 };
+    }
+
+    sub.work.range.end = next;
+    if (not is_zero(range.end) and (is_zero(next) or is_before(range.end, next)))
+      sub.work.range.end = range.end;
+
+    __atomic_add_fetch(&unfinished, 1, __ATOMIC_RELEASE);
+
+    if (is_zero(next) or (not is_zero(range.end) and not is_before(next, range.end)))
+      break;
+
+    previous = start;
+    start = next;
+  }
+}
+
+void start_subtree_schedule(search_range const &range)
+{
+  work_item first;
+
+  first.range = range;
+
+  subtree_count = 0;
+  unfinished = 0;
+
+  // There is nothing to do for an empty range.
+  if (is_zero(range.end) or is_before(range.start, range.end))
+    add_subtrees(first, 1);
+}
+
+// Return the subtree that nobody has taken with the best yield or
+// subtree_count, if there is none.
+static size_t find_best()
+{
+  size_t best = subtree_count;
+
+  for (size_t i = 0; i < subtree_count; i++) {
+    auto const &sub = subtrees[i];
+
+    if (sub.done or sub.taken)
+      continue;
+
+    // Compare (found + 1) / (executions + 1) without dividing. Subtrees that
+    // were never searched come out as one, which nothing else beats.
+    if (best == subtree_count or
+        (uint64_t)(sub.found + 1) * (subtrees[best].executions + 1) >
+        (uint64_t)(subtrees[best].found + 1) * (sub.executions + 1))
+      best = i;
+  }
+
+  return best;
+}
+
+bool take_subtree(size_t &id, work_item &work)
+{
+  lock();
+
+  size_t best = find_best();
+
+  if (best != subtree_count) {
+    auto &sub = subtrees[best];
+
+    // The walk only continues at the second byte, if it is not about to move
+    // on to the next first byte.
+    if (sub.depth == 1 and sub.work.resume and sub.work.position.increment_at > 0 and
+        splits < max_splits) {
+      work_item const parent = sub.work;
+      size_t const first_child = subtree_count;
+
+      add_subtrees(parent, 2);
+      subtrees[first_child].executions = sub.executions;
+      subtrees[first_child].found = sub.found;
+
+      // Only after adding the new subtrees, so we are never done in between.
+      sub.done = true;
+      __atomic_sub_fetch(&unfinished, 1, __ATOMIC_RELEASE);
+      splits++;
+
+      best = find_best();
+    }
+  }
+
+  bool const found = best != subtree_count;
+
+  if (found) {
+    subtrees[best].taken = true;
+    id = best;
+    work = subtrees[best].work;
+  }
+
+  unlock();
+  return found;
+}
+
+void return_subtree(size_t id, work_item const &work, size_t executions, size_t found, bool done)
+{
+  lock();
+
+  auto &sub = subtrees[id];
+
+  sub.work = work;
+  sub.executions = sub.executions / 2 + executions;
+  sub.found = sub.found / 2 + found;
+  sub.taken = false;
+
+  if (done) {
+    sub.done = true;
+    __atomic_sub_fetch(&unfinished, 1, __ATOMIC_RELEASE);
+  }
+
+  unlock();
+}
+
+bool is_schedule_done()
+{
+  return __atomic_load_n(&unfinished, __ATOMIC_ACQUIRE) == 0;
+}
+
+size_t get_split_subtrees()
+{
+  return splits;
+}
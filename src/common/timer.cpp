@@ -0,0 +1,45 @@
+#include "timer.hpp"
+#include "x86.hpp"
+
+// Measure the TSC frequency using channel 2 of the PIT. This takes 10ms.
+static uint64_t measure_tsc_frequency()
+{
+  static constexpr uint32_t pit_frequency = 1193182;
+  static constexpr uint32_t pit_ticks = pit_frequency / 100;
+
+  uint8_t const speaker = inb(0x61);
+
+  // Enable the gate of channel 2, but keep the speaker off.
+  outb(0x61, (speaker & ~0x02) | 0x01);
+
+  // Channel 2, lobyte/hibyte access, mode 0 (interrupt on terminal count)
+  outb(0x43, 0xB0);
+  outb(0x42, pit_ticks & 0xFF);
+  outb(0x42, pit_ticks >> 8);
+
+  uint64_t const start = rdtsc();
+
+  // Wait for the output of channel 2 to go high.
+  while (not (inb(0x61) & 0x20))
+    pause();
+
+  uint64_t const cycles = rdtsc() - start;
+
+  outb(0x61, speaker);
+  return cycles * (pit_frequency / pit_ticks);
+}
+
+uint64_t get_tsc_frequency()
+{
+  static uint64_t tsc_frequency = measure_tsc_frequency();
+  return tsc_frequency;
+}
+
+void delay_us(uint64_t us)
+{
+  uint64_t const cycles = get_tsc_frequency() / 1000000 * us;
+  uint64_t const start = rdtsc();
+
+  while (rdtsc() - start < cycles)
+    pause();
+}
@@ -1,4 +1,11 @@
+#include <cstring>
+
+#include "compressed_output.hpp"
+#include "cpu_output.hpp"
 #include "output_device.hpp"
+#include "range_output.hpp"
+#include "record_output.hpp"
+#include "search.hpp"
 #include "util.hpp"
 #include "x86.hpp"
 
@@ -7,9 +14,102 @@ extern "C" void (*_init_array_end[])();
 
 static output_device * const output_device = output_device::make();
 
+static char output_buffer[4096];
+static size_t output_length = 0;
+static size_t output_flush_size = 0;
+static bool output_compressed = false;
+
+static_assert(sizeof(output_buffer) <= max_frame_data, "Output buffer doesn't fit into a frame");
+
+void set_output_flush_size(size_t size)
+{
+  output_flush_size = size;
+}
+
+void finish_output()
+{
+  flush_output();
+  output_device->sync();
+}
+
+void configure_output(serial_settings const &settings)
+{
+  flush_output();
+  output_device->configure(settings);
+}
+
+void write_unbuffered_output(const char *data, size_t length)
+{
+  flush_output();
+  output_device->write(data, length);
+  output_device->sync();
+}
+
+uart *output_serial_port()
+{
+  return output_device->serial_port();
+}
+
+void set_output_compression(bool compress)
+{
+  flush_output();
+  output_compressed = compress;
+}
+
+void flush_output()
+{
+  if (output_length == 0)
+    return;
+
+  if (output_compressed) {
+    size_t frame_length;
+    const char *frame = compress_frame(output_buffer, output_length, frame_length);
+
+    output_device->write(frame, frame_length);
+  } else {
+    output_device->write(output_buffer, output_length);
+  }
+
+  output_length = 0;
+}
+
+// Append to the buffer and write it, once we are at the end of a line and have
+// enough.
+static void append_output(const char *data, size_t length, bool lines)
+{
+  for (size_t i = 0; i < length; i++) {
+    if (output_length == sizeof(output_buffer))
+      flush_output();
+
+    output_buffer[output_length++] = data[i];
+
+    if (lines and data[i] == '\n' and output_length >= output_flush_size)
+      flush_output();
+  }
+
+  if (not lines and output_length >= output_flush_size)
+    flush_output();
+}
+
 void print(const char *str)
 {
-  output_device->puts(str);
+  // Binary records and ranges come before everything that is printed after
+  // them.
+  flush_records();
+  flush_ranges();
+
+  if (is_output_buffered())
+    buffer_output(str);
+  else
+    append_output(str, strlen(str), true);
+}
+
+void write_output(const char *data, size_t length)
+{
+  if (is_output_buffered())
+    buffer_output(data, length);
+  else
+    append_output(data, length, false);
 }
 
 __attribute__((noinline)) void print(formatted_int const &v)
@@ -17,15 +117,16 @@ __attribute__((noinline)) void print(formatted_int const &v)
   static const char hexdigit[] = "0123456789ABCDEF";
   assert(v.base <= sizeof(hexdigit), "Invalid base");
 
-  char output[64];
-  assert(v.width <= sizeof(output), "Invalid width");
+  char output[65];
+  assert(v.width < sizeof(output), "Invalid width");
 
-  char *p = output;
+  char *p = output + sizeof(output) - 1;
+  *p = 0;
   uint64_t value = v.v;
   unsigned width = v.width;
 
   do {
-    *(p++) = hexdigit[value % v.base];
+    *(--p) = hexdigit[value % v.base];
     if (width) width--;
 
     value = value / v.base;
@@ -34,9 +135,63 @@ __attribute__((noinline)) void print(formatted_int const &v)
   if (v.prefix and v.base == 16)
     print("0x");
 
-  do {
-    output_device->putc(*(--p));
-  } while (p != output);
+  print(p);
+}
+
+int hex_digit(char c)
+{
+  if (c >= '0' and c <= '9')
+    return c - '0';
+  if (c >= 'a' and c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' and c <= 'F')
+    return c - 'A' + 10;
+
+  return -1;
+}
+
+size_t parse_hex(const char *value)
+{
+  size_t res = 0;
+
+  for (; hex_digit(*value) >= 0; value++)
+    res = res * 16 + hex_digit(*value);
+
+  return res;
+}
+
+instruction_bytes parse_bytes(const char *value)
+{
+  instruction_bytes res {};
+
+  for (size_t i = 0; i < 2 * sizeof(res.raw) and hex_digit(value[i]) >= 0; i++)
+    res.raw[i / 2] |= hex_digit(value[i]) << (i % 2 ? 0 : 4);
+
+  return res;
+}
+
+char *format_compact_bytes(char *out, instruction_bytes const &instr)
+{
+  static const char hexdigit[] = "0123456789ABCDEF";
+  size_t length = sizeof(instr.raw);
+
+  while (length > 0 and instr.raw[length - 1] == 0)
+    length--;
+
+  for (size_t i = 0; i < length; i++) {
+    *out++ = hexdigit[instr.raw[i] >> 4];
+    *out++ = hexdigit[instr.raw[i] & 0xF];
+  }
+
+  return out;
+}
+
+void print_compact_bytes(instruction_bytes const &instr)
+{
+  char digits[2 * sizeof(instr.raw) + 1];
+
+  *format_compact_bytes(digits, instr) = 0;
+  print(digits);
 }
 
 void fail_assert(const char *s)
@@ -47,6 +202,13 @@ void fail_assert(const char *s)
 
 void wait_forever()
 {
+  // Application processors don't own the buffer. See cpu_output.
+  if (not is_output_buffered()) {
+    flush_records();
+    flush_ranges();
+    finish_output();
+  }
+
   while (true)
     asm volatile ("cli ; hlt");
 }
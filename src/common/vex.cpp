@@ -0,0 +1,125 @@
+#include "vex.hpp"
+#include "util.hpp"
+
+// In 32-bit mode, C4, C5 and 62 are only VEX and EVEX prefixes when the
+// inverted R and X bits are set. Otherwise, they are LES, LDS and BOUND. So
+// only sample the extension bits that can be used.
+#ifdef __x86_64__
+static const uint8_t sampled_vex_ext = 0x7;  // R X B
+static const uint8_t sampled_evex_ext = 0xF; // R X B R'
+#else
+static const uint8_t sampled_vex_ext = 0x1;
+static const uint8_t sampled_evex_ext = 0x2;
+#endif
+
+// How many combinations of the enumerated fields each kind of prefix has.
+static const size_t vex2_combinations = 4 * 2;          // pp L
+static const size_t vex3_combinations = 4 * 2 * 2 * 32; // pp L W mmmmm
+static const size_t xop_combinations = 4 * 2 * 2 * 24;  // pp L W mmmmm=8..31
+static const size_t evex_combinations = 4 * 4 * 2 * 2 * 8; // pp L'L W b mmm
+
+// The bits of the fields that are sampled.
+struct sampled_fields {
+  uint8_t ext;
+  uint8_t vvvv;
+  uint8_t v_high;               // EVEX V'
+  uint8_t z;
+  uint8_t aaa;
+};
+
+// Take the next field with n values out of a combination.
+static size_t take(size_t &combination, size_t n)
+{
+  size_t const field = combination % n;
+
+  combination /= n;
+  return field;
+}
+
+// Sample the register fields and extension bits for a combination. These are
+// stored inverted, so zero means none. vvvv is never zero, so the sampled
+// prefix always differs from the one without registers.
+static sampled_fields sample(size_t combination)
+{
+  // A 32-bit integer hash, so neighbouring combinations get unrelated
+  // samples.
+  uint32_t h = combination + 1;
+
+  h = (h ^ (h >> 16)) * 0x45D9F3B;
+  h = (h ^ (h >> 16)) * 0x45D9F3B;
+  h ^= h >> 16;
+
+  return { (uint8_t)(h & 0xF), (uint8_t)(1 + (h >> 4) % 15), (uint8_t)((h >> 8) & 1),
+           (uint8_t)((h >> 9) & 1), (uint8_t)((h >> 10) & 7) };
+}
+
+static search_range prefix_range(uint8_t const *bytes, size_t length)
+{
+  search_range range {};
+
+  for (size_t i = 0; i < length; i++)
+    range.start.raw[i] = range.end.raw[i] = bytes[i];
+
+  // The range ends at the next prefix of the same length.
+  for (size_t i = length; i-- > 0;) {
+    if (++range.end.raw[i] != 0)
+      break;
+  }
+
+  return range;
+}
+
+size_t vex_prefix_count()
+{
+  return 2 * (vex2_combinations + vex3_combinations + xop_combinations + evex_combinations);
+}
+
+search_range vex_prefix_range(size_t index)
+{
+  size_t combination = index / 2;
+  auto const s = (index % 2) ? sample(combination) : sampled_fields {};
+
+  uint8_t const vex_ext = (~s.ext & sampled_vex_ext) | (~sampled_vex_ext & 0x7);
+  uint8_t const evex_ext = (~s.ext & sampled_evex_ext) | (~sampled_evex_ext & 0xF);
+  uint8_t const vvvv = ~s.vvvv & 0xF;
+
+  if (combination < vex2_combinations) {
+    size_t const pp = take(combination, 4);
+    size_t const l = take(combination, 2);
+    uint8_t const bytes[] { 0xC5, (uint8_t)((vex_ext >> 2) << 7 | vvvv << 3 | l << 2 | pp) };
+
+    return prefix_range(bytes, array_size(bytes));
+  }
+  combination -= vex2_combinations;
+
+  if (combination < vex3_combinations + xop_combinations) {
+    bool const xop = combination >= vex3_combinations;
+
+    if (xop)
+      combination -= vex3_combinations;
+
+    size_t const pp = take(combination, 4);
+    size_t const l = take(combination, 2);
+    size_t const w = take(combination, 2);
+    // XOP uses maps 8 and above. Below that, 8F is POP.
+    size_t const map = combination + (xop ? 8 : 0);
+    uint8_t const bytes[] { (uint8_t)(xop ? 0x8F : 0xC4),
+                            (uint8_t)(vex_ext << 5 | map),
+                            (uint8_t)(w << 7 | vvvv << 3 | l << 2 | pp) };
+
+    return prefix_range(bytes, array_size(bytes));
+  }
+  combination -= vex3_combinations + xop_combinations;
+
+  size_t const pp = take(combination, 4);
+  size_t const ll = take(combination, 4);
+  size_t const w = take(combination, 2);
+  size_t const b = take(combination, 2);
+  size_t const map = combination;
+  uint8_t const bytes[] { 0x62,
+                          (uint8_t)(evex_ext << 4 | map),
+                          (uint8_t)(w << 7 | vvvv << 3 | 1 << 2 | pp),
+                          (uint8_t)(s.z << 7 | ll << 5 | b << 4 | (~s.v_high & 1) << 3 | s.aaa) };
+
+  return prefix_range(bytes, array_size(bytes));
+}
@@ -0,0 +1,226 @@
+#include <cstdint>
+#include <cstring>
+
+#include "pci.hpp"
+#include "virtio_console.hpp"
+#include "x86.hpp"
+
+namespace {
+
+enum : uint16_t {
+  VIRTIO_VENDOR_ID = 0x1AF4,
+
+  // A console with the legacy interface. Devices that only have the modern
+  // interface use another ID.
+  VIRTIO_CONSOLE_DEVICE_ID = 0x1003,
+};
+
+// The registers of the legacy interface in the I/O BAR.
+enum : uint16_t {
+  VIRTIO_GUEST_FEATURES = 0x04,
+  VIRTIO_QUEUE_PFN = 0x08,
+  VIRTIO_QUEUE_SIZE = 0x0C,
+  VIRTIO_QUEUE_SELECT = 0x0E,
+  VIRTIO_QUEUE_NOTIFY = 0x10,
+  VIRTIO_STATUS = 0x12,
+};
+
+enum : uint8_t {
+  STATUS_ACKNOWLEDGE = 0x01,
+  STATUS_DRIVER = 0x02,
+  STATUS_DRIVER_OK = 0x04,
+  STATUS_FAILED = 0x80,
+};
+
+enum : uint16_t {
+  VIRTQ_AVAIL_F_NO_INTERRUPT = 1,
+  VIRTQ_USED_F_NO_NOTIFY = 1,
+};
+
+// Without the multiport feature, queue 0 receives from the console and queue
+// 1 transmits to it.
+const uint16_t transmit_queue = 1;
+
+// The legacy interface takes the page number of the queue and puts the used
+// ring on a page of its own.
+const size_t queue_align = 4096;
+
+// The device picks the queue size. Qemu's queues have 128 entries.
+const size_t max_queue_size = 256;
+
+// Each buffer has the descriptor with its index.
+const size_t tx_buffer_count = 8;
+const size_t tx_buffer_size = 4096;
+
+struct virtq_desc {
+  uint64_t addr;
+  uint32_t len;
+  uint16_t flags;
+  uint16_t next;
+};
+
+struct virtq_used_elem {
+  uint32_t id;
+  uint32_t len;
+};
+
+constexpr size_t align_up(size_t v, size_t alignment)
+{
+  return (v + alignment - 1) / alignment * alignment;
+}
+
+// The descriptors and the available ring come first. Both have queue_size
+// entries, and the ring has flags, index and the used event around them.
+constexpr size_t used_ring_offset(size_t queue_size)
+{
+  return align_up(sizeof(virtq_desc) * queue_size + sizeof(uint16_t) * (3 + queue_size), queue_align);
+}
+
+constexpr size_t queue_memory_size(size_t queue_size)
+{
+  return used_ring_offset(queue_size) +
+    align_up(sizeof(uint16_t) * 3 + sizeof(virtq_used_elem) * queue_size, queue_align);
+}
+
+}
+
+// The kernel image is identity mapped, so the device sees these at the
+// addresses we see them at.
+alignas(queue_align) static char queue_memory[queue_memory_size(max_queue_size)];
+alignas(queue_align) static char tx_buffers[tx_buffer_count][tx_buffer_size];
+
+static uint16_t io_base;
+static uint16_t queue_size;
+
+static virtq_desc *descriptors;
+static uint16_t *avail_idx;
+static uint16_t *avail_ring;
+static uint16_t *used_flags;
+static uint16_t *used_idx;
+static virtq_used_elem *used_ring;
+
+// The index of the next buffer we make available and of the next one the
+// device gives back. Both wrap around like the indexes in the rings.
+static uint16_t next_avail = 0;
+static uint16_t next_used = 0;
+
+static bool tx_buffer_busy[tx_buffer_count];
+static size_t next_tx_buffer = 0;
+
+static void set_status(uint8_t status)
+{
+  outb(io_base + VIRTIO_STATUS, status);
+}
+
+// Take back the buffers the device is done with.
+static void reclaim_buffers()
+{
+  uint16_t const used = __atomic_load_n(used_idx, __ATOMIC_ACQUIRE);
+
+  for (; next_used != used; next_used++) {
+    uint32_t const id = used_ring[next_used % queue_size].id;
+
+    if (id < tx_buffer_count)
+      tx_buffer_busy[id] = false;
+  }
+}
+
+static void send_buffer(const char *data, size_t length)
+{
+  size_t const buffer = next_tx_buffer;
+
+  while (tx_buffer_busy[buffer]) {
+    reclaim_buffers();
+    pause();
+  }
+
+  next_tx_buffer = (buffer + 1) % tx_buffer_count;
+  tx_buffer_busy[buffer] = true;
+
+  memcpy(tx_buffers[buffer], data, length);
+  descriptors[buffer].len = length;
+
+  avail_ring[next_avail % queue_size] = buffer;
+  __atomic_store_n(avail_idx, ++next_avail, __ATOMIC_RELEASE);
+
+  // The device may tell us that it is still busy with earlier buffers and
+  // sees this one without a notification. The new index has to be visible
+  // before we look.
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  if (not (__atomic_load_n(used_flags, __ATOMIC_ACQUIRE) & VIRTQ_USED_F_NO_NOTIFY))
+    outw(io_base + VIRTIO_QUEUE_NOTIFY, transmit_queue);
+}
+
+bool setup_virtio_console()
+{
+  pci_function f;
+
+  if (not find_pci_function(VIRTIO_VENDOR_ID, VIRTIO_CONSOLE_DEVICE_ID, f))
+    return false;
+
+  uint32_t const bar = f.read32(PCI_BAR0);
+
+  if (not (bar & PCI_BAR_IO))
+    return false;
+
+  io_base = bar & PCI_BAR_IO_MASK;
+  f.write16(PCI_COMMAND, f.read16(PCI_COMMAND) | PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+
+  set_status(0);
+  set_status(STATUS_ACKNOWLEDGE);
+  set_status(STATUS_ACKNOWLEDGE | STATUS_DRIVER);
+
+  // We don't need any features. Without multiport, the device only has the
+  // console port and considers it open once we are ready.
+  outl(io_base + VIRTIO_GUEST_FEATURES, 0);
+
+  outw(io_base + VIRTIO_QUEUE_SELECT, transmit_queue);
+  queue_size = inw(io_base + VIRTIO_QUEUE_SIZE);
+
+  if (queue_size < tx_buffer_count or queue_size > max_queue_size or
+      (queue_size & (queue_size - 1)) != 0) {
+    set_status(STATUS_FAILED);
+    return false;
+  }
+
+  char * const avail = queue_memory + sizeof(virtq_desc) * queue_size;
+  char * const used = queue_memory + used_ring_offset(queue_size);
+
+  descriptors = reinterpret_cast<virtq_desc *>(queue_memory);
+  avail_idx = reinterpret_cast<uint16_t *>(avail) + 1;
+  avail_ring = reinterpret_cast<uint16_t *>(avail) + 2;
+  used_flags = reinterpret_cast<uint16_t *>(used);
+  used_idx = reinterpret_cast<uint16_t *>(used) + 1;
+  used_ring = reinterpret_cast<virtq_used_elem *>(used + 2 * sizeof(uint16_t));
+
+  for (size_t i = 0; i < tx_buffer_count; i++)
+    descriptors[i].addr = reinterpret_cast<uintptr_t>(tx_buffers[i]);
+
+  // We wait for buffers by looking at the used ring.
+  *reinterpret_cast<uint16_t *>(avail) = VIRTQ_AVAIL_F_NO_INTERRUPT;
+
+  outl(io_base + VIRTIO_QUEUE_PFN, reinterpret_cast<uintptr_t>(queue_memory) / queue_align);
+  set_status(STATUS_ACKNOWLEDGE | STATUS_DRIVER | STATUS_DRIVER_OK);
+
+  return true;
+}
+
+void virtio_console_write(const char *data, size_t length)
+{
+  while (length > 0) {
+    size_t const chunk = length < tx_buffer_size ? length : tx_buffer_size;
+
+    send_buffer(data, chunk);
+    data += chunk;
+    length -= chunk;
+  }
+}
+
+void virtio_console_sync()
+{
+  while (next_used != next_avail) {
+    reclaim_buffers();
+    pause();
+  }
+}
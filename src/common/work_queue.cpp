@@ -0,0 +1,100 @@
+#include <cstring>
+
+#include "uart.hpp"
+#include "util.hpp"
+#include "work_queue.hpp"
+
+static uart *queue_port = nullptr;
+
+// Whether the port also carries the output. Then we send through the output
+// device, so our lines come after the output before them and the device keeps
+// its settings and its own way of sending.
+static bool shares_output = false;
+
+void start_work_queue(uint16_t port)
+{
+  uart * const output_port = output_serial_port();
+
+  if (output_port and output_port->port() == port) {
+    queue_port = output_port;
+    shares_output = true;
+    return;
+  }
+
+  static uart queue_uart { port };
+
+  queue_port = &queue_uart;
+}
+
+static void send(const char *str)
+{
+  if (shares_output) {
+    write_unbuffered_output(str, strlen(str));
+    return;
+  }
+
+  for (; *str; str++)
+    queue_port->putc(*str);
+}
+
+// Receive a line without its line break. Lines that don't fit are cut off.
+static void receive_line(char *line, size_t size)
+{
+  size_t length = 0;
+
+  for (char c; (c = queue_port->getc()) != '\n';) {
+    if (c != '\r' and length + 1 < size)
+      line[length++] = c;
+  }
+
+  line[length] = 0;
+}
+
+bool next_queued_work(search_range &range)
+{
+  assert(queue_port, "Work queue not started");
+
+  char line[64];
+
+  send("next\n");
+
+  for (;;) {
+    receive_line(line, sizeof(line));
+
+    if (strcmp(line, "stop") == 0)
+      return false;
+
+    size_t const command = strcspn(line, " ");
+    if (line[command] != ' ')
+      continue;
+
+    line[command] = 0;
+    if (strcmp(line, "work") != 0)
+      continue;
+
+    const char *start = line + command + 1;
+    const char *end = start + strcspn(start, ",");
+
+    range.start = parse_bytes(start);
+    range.end = *end ? parse_bytes(end + 1) : instruction_bytes {};
+    return true;
+  }
+}
+
+void finish_queued_work(search_range const &range)
+{
+  assert(queue_port, "Work queue not started");
+
+  // The line goes out in one piece, so no output gets into the middle of it.
+  char line[sizeof("done ,\n") + 4 * sizeof(instruction_bytes::raw)];
+  char *out = line;
+
+  memcpy(out, "done ", 5);
+  out = format_compact_bytes(out + 5, range.start);
+  *out++ = ',';
+  out = format_compact_bytes(out, range.end);
+  *out++ = '\n';
+  *out = 0;
+
+  send(line);
+}
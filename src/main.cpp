@@ -3,53 +3,61 @@
 #include <cstdlib>
 
 #include "arch.hpp"
+#include "benchmark.hpp"
+#include "byte_roles.hpp"
+#include "cpu_output.hpp"
 #include "cpuid.hpp"
+#include "exception_equivalence.hpp"
 #include "execution_attempt.hpp"
 #include "logo.hpp"
+#include "output_device.hpp"
+#include "prefix_pruning.hpp"
+#include "probe.hpp"
+#include "range_output.hpp"
+#include "record_output.hpp"
 #include "search.hpp"
+#include "subtree_schedule.hpp"
+#include "timer.hpp"
 #include "util.hpp"
+#include "vex.hpp"
+#include "work_item.hpp"
+#include "work_queue.hpp"
 #include "x86.hpp"
 #include "cpu_features.hpp"
 
-static execution_attempt find_instruction_length(cpu_features const &features,
-						 instruction_bytes const &instr)
-{
-  exception_frame ef;
-  size_t i;
-
-  for (i = 1; i <= array_size(instr.raw); i++) {
-    size_t const page_offset =  page_size - i;
-    char * const instr_start = get_user_page_backing() + page_offset;
-    uintptr_t const guest_ip = get_user_page() + page_offset;
-    memcpy(instr_start, instr.raw, i);
+// Remembers the longest prefix of the last candidate that is known to be an
+// incomplete instruction. Consecutive candidates usually share most of their
+// bytes, so we don't have to probe these lengths again.
+class incomplete_prefix_memo {
+  instruction_bytes prefix_ {};
+  size_t length_ = 0;
 
-    ef = execute_user(guest_ip);
+public:
 
-    // The instruction hasn't been completely fetched, if we get an instruction
-    // fetch page fault from userspace.
-    //
-    // The check for RIP is necessary, because otherwise we cannot correctly
-    // guess the length of XBEGIN with an abort address following the XBEGIN
-    // instruction.
+  // Return how many leading bytes of the instruction are known to not form a
+  // complete instruction.
+  size_t known_incomplete(instruction_bytes const &instr) const
+  {
+    size_t i = 0;
 
-    mword_t const pt_exc_instr = features.has_nx ? EXC_PF_ERR_I : 0;
-    mword_t const pt_exc_mask = EXC_PF_ERR_P | EXC_PF_ERR_U | pt_exc_instr;
-    mword_t const pt_exc_expect = EXC_PF_ERR_U | pt_exc_instr;
+    while (i < length_ and instr.raw[i] == prefix_.raw[i])
+      i++;
 
-    bool const incomplete_instruction_fetch =
-      ef.vector == 14 and
-      (ef.error_code & pt_exc_mask) == pt_exc_expect and
-      get_cr2() == get_user_page() + page_size and
-      ef.ip == guest_ip;
-
-    if (not incomplete_instruction_fetch)
-      break;
+    return i;
   }
 
-  return { (uint8_t)i, (uint8_t)ef.vector };
-}
+  // Remember the result of probing an instruction. Every length shorter than
+  // the found one is an incomplete instruction.
+  void remember(instruction_bytes const &instr, execution_attempt const &attempt)
+  {
+    prefix_ = instr;
+    length_ = attempt.length - 1;
+  }
+};
 
-static void self_test_instruction_length(cpu_features const &features)
+// Check the linear probe and the probe that is used for the search against
+// known instruction lengths.
+static void self_test_instruction_length(cpu_features const &features, probe_mode mode)
 {
   static const struct {
     size_t length;
@@ -88,8 +96,9 @@ static void self_test_instruction_length(cpu_features const &features)
   bool success = true;
 
   for (auto const &test : tests) {
-    auto attempt = find_instruction_length(features, test.instr);
-    if (attempt.length != test.length) {
+    auto linear = find_instruction_length(features, probe_mode::linear, test.instr);
+    auto probed = find_instruction_length(features, mode, test.instr);
+    if (linear.length != test.length or linear != probed) {
       success = false;
     }
   }
@@ -100,6 +109,35 @@ static void self_test_instruction_length(cpu_features const &features)
   }
 }
 
+// Check that the parts of a search without prefixes have about the same amount
+// of work. Most of it is in the escape maps behind 0F, so this only works out,
+// if parts can end inside of them.
+static void self_test_search_split()
+{
+  search_estimate const estimate;
+  uint64_t const total = estimate.total_work();
+  uint64_t const escape_work = estimate.work_before({ 0x10 }) - estimate.work_before({ 0x0F });
+  bool success = 2 * escape_work > total;
+
+  for (size_t parts = 2; parts <= 16; parts++) {
+    for (size_t part = 0; part < parts; part++) {
+      auto const range = estimate.split({}, part, parts);
+      uint64_t const start = estimate.work_before(range.start);
+      uint64_t const end = is_zero(range.end) ? total : estimate.work_before(range.end);
+      uint64_t const share = total / parts;
+
+      // Parts end in front of the unit of work that their share ends in.
+      if (end < start or end - start > share + 2 or end - start + 2 < share)
+        success = false;
+    }
+  }
+
+  format("Search split: ", (success ? "OK" : "b0rken!"), "\n");
+  if (not success) {
+    wait_forever();
+  }
+}
+
 static void print_instruction(instruction_bytes const &instr,
                               execution_attempt const &attempt)
 {
@@ -116,29 +154,64 @@ static void print_instruction(instruction_bytes const &instr,
   format("\n");
 }
 
-static bool is_interesting_change(execution_attempt const &last,
-                                  execution_attempt const &now)
+// Print instruction bytes without trailing zeroes. If they are all zeroes,
+// print the given text instead.
+static void print_bytes(instruction_bytes const &instr, const char *zero)
 {
-  if (last == now)
-    return false;
+  size_t length = sizeof(instr.raw);
 
-  // This is a special case for FXSAVE, which has an alignment restriction on
-  // its memory operand. It will flip between #GP and #PF depending on the
-  // memory operand. Mark this case as non-interesting.
-  if (last.length == now.length and
-      ((last.exception == 0xE and now.exception == 0xD) or
-       (last.exception == 0xD and now.exception == 0xE)))
-    return false;
+  while (length > 0 and instr.raw[length - 1] == 0)
+    length--;
 
-  return true;
+  if (length == 0) {
+    format(zero);
+    return;
+  }
+
+  for (size_t i = 0; i < length; i++)
+    format(i ? " " : "", hex(instr.raw[i], 2, false));
 }
 
+// How many resume= options we take.
+const size_t max_resumes = 64;
+
+// The checkpoints from resume= options. Together they are too large for the
+// boot stack, so they live here instead of in the options.
+static work_item parsed_resumes[max_resumes];
+
+// Which candidates we execute.
+enum class search_mode {
+  // Walk the instruction space byte by byte.
+  search,
+
+  // Random candidates. See basic_random_search.
+  random,
+
+  // Walk the opcodes after each VEX, XOP and EVEX prefix. See
+  // vex_prefix_range().
+  vex,
+};
+
+enum class output_format {
+  // One line per instruction. See print_instruction().
+  text,
+
+  // Binary records. See record_output.
+  binary,
+
+  // Text with ranges of instructions that only differ in their last byte. See
+  // range_output.
+  ranges,
+};
+
 struct options {
   // We allow this many prefixes. Limiting prefixes is useful, because
   // they make the search space explode.
   size_t prefixes = 0;
 
-  // After how many instructions do we stop. Zero means don't stop.
+  // After how many candidates on all CPUs together do we stop. A candidate
+  // takes as many executions as its probe mode needs. Candidates that byte
+  // roles or prefix pruning skip don't count. Zero means don't stop.
   size_t stop_after = 0;
 
   // What prefixes to use. Zero means no prefixes are valid to use. The bits of the number are the opcode groups.
@@ -146,8 +219,153 @@ struct options {
 
   // What prefixes to detect. Zero means no prefixes are valid. The bits of the number are the opcode groups.
   size_t detect_prefixes = 0xFF;
+
+  // How to find instruction lengths.
+  probe_mode probe = probe_mode::binary;
+
+  // Only try one value of each addressing class of ModRM and SIB bytes. See
+  // byte_roles.
+  bool modrm_classes = false;
+
+  // Skip the values of immediate and displacement bytes. See byte_roles.
+  bool skip_tails = false;
+
+  // Skip prefixed opcodes that behave like without the prefixes. See
+  // prefix_pruning.
+  bool prune_prefixes = false;
+
+  // Which exceptions count as the same at the same length and whether we
+  // learn more of them.
+  exception_equivalence exceptions;
+
+  // Run benchmarks with this many iterations instead of searching. Zero means
+  // don't run benchmarks.
+  size_t benchmark = 0;
+
+  // Write output to the output device once this many bytes of complete lines
+  // are buffered. Zero means after every line. See flush_output().
+  size_t output_flush = 0;
+
+  // How to print instructions.
+  output_format output = output_format::text;
+
+  // Compress the output. See compressed_output.
+  bool compress_output = false;
+
+  // Where output goes on bare metal. See uart.
+  serial_settings serial;
+
+  // On how many CPUs to search. Zero means all of them.
+  size_t cpus = 0;
+
+  // Which part of the instruction space to search.
+  search_range range {};
+
+  // Only search this part of the range. The parts are about equal in size.
+  size_t shard = 0;
+  size_t shards = 1;
+
+  // How often to print checkpoints, in candidates and in seconds. Zero means
+  // never.
+  size_t checkpoint = 0;
+  size_t checkpoint_seconds = 0;
+
+  // Which candidates to execute.
+  search_mode mode = search_mode::search;
+
+  // Search the subtrees that find the most first instead of walking the range
+  // in order. See subtree_schedule.
+  bool schedule_by_yield = false;
+
+  // Take the ranges to search from a tool on the host instead of searching the
+  // shard. This is the I/O port of the serial port to talk to it over. Zero
+  // means there is no tool. See work_queue.
+  uint16_t queue_port = 0;
+
+  // Random candidates are drawn from the seed, so the same options give the
+  // same candidates. fixed and mask are for the bytes after the prefixes. See
+  // basic_random_search.
+  uint64_t seed = 1;
+  instruction_bytes fixed {};
+  instruction_bytes mask {};
+
+  // Continue from this many checkpoints in parsed_resumes instead of searching
+  // the range.
+  size_t resume_count = 0;
 };
 
+// Parse a list of exception pairs, like D:E,11:D, into the table. Replaces the
+// pairs that were there, so none or any other word clears the table.
+static void parse_exception_pairs(const char *value, exception_equivalence &exceptions)
+{
+  exceptions.clear();
+
+  while (*value) {
+    size_t const pair = strcspn(value, ",");
+    size_t const colon = strcspn(value, ":");
+
+    if (colon < pair and hex_digit(value[0]) >= 0 and hex_digit(value[colon + 1]) >= 0)
+      exceptions.add(parse_hex(value), parse_hex(value + colon + 1));
+
+    value += pair;
+    if (*value)
+      value++;
+  }
+}
+
+// Parse learned exception pairs, like D:E:3+11:D:2, where the last number of
+// each is the position where we learned it.
+static void parse_learned_pairs(const char *value, exception_memory &memory)
+{
+  while (hex_digit(*value) >= 0 and memory.learned_count < exception_memory::max_learned) {
+    learned_exception_pair pair;
+
+    pair.a = parse_hex(value);
+    value += strcspn(value, ":");
+    if (*value)
+      value++;
+    pair.b = parse_hex(value);
+    value += strcspn(value, ":");
+    if (*value)
+      value++;
+    pair.at = parse_hex(value);
+    memory.learned[memory.learned_count++] = pair;
+
+    value += strcspn(value, "+");
+    if (*value)
+      value++;
+  }
+}
+
+// Parse what print_checkpoint() prints after resume=. Checkpoints without the
+// exception fields at the end resume without learned pairs.
+static work_item parse_resume(const char *value)
+{
+  const char *fields[8] {};
+  work_item res;
+
+  for (auto &field : fields) {
+    field = value;
+    value += strcspn(value, ",");
+    if (*value)
+      value++;
+  }
+
+  res.resume = true;
+  res.position.current = parse_bytes(fields[0]);
+  res.position.increment_at = parse_hex(fields[1]);
+  res.last_attempt.exception = parse_hex(fields[2]);
+  res.last_attempt.length = parse_hex(fields[3]);
+  res.range.start = res.position.current;
+  res.range.end = parse_bytes(fields[4]);
+  res.exceptions.before_last.exception = parse_hex(fields[5]);
+  res.exceptions.before_last.length = parse_hex(fields[6]);
+  res.exceptions.last_candidate = res.position.current;
+  parse_learned_pairs(fields[7], res.exceptions);
+
+  return res;
+}
+
 // This will modify cmdline.
 static options parse_and_destroy_cmdline(char *cmdline)
 {
@@ -170,48 +388,709 @@ static options parse_and_destroy_cmdline(char *cmdline)
       res.detect_prefixes = atoi(value);
     if (strcmp(key, "stop_after") == 0)
       res.stop_after = atoi(value);
+    if (strcmp(key, "probe") == 0) {
+      if (strcmp(value, "linear") == 0)
+        res.probe = probe_mode::linear;
+      if (strcmp(value, "binary") == 0)
+        res.probe = probe_mode::binary;
+      if (strcmp(value, "infer") == 0)
+        res.probe = probe_mode::infer;
+      if (strcmp(value, "batch") == 0)
+        res.probe = probe_mode::batch;
+      if (strcmp(value, "verify") == 0)
+        res.probe = probe_mode::verify;
+    }
+    if (strcmp(key, "modrm") == 0) {
+      if (strcmp(value, "all") == 0)
+        res.modrm_classes = false;
+      if (strcmp(value, "classes") == 0)
+        res.modrm_classes = true;
+    }
+    if (strcmp(key, "tails") == 0) {
+      if (strcmp(value, "all") == 0)
+        res.skip_tails = false;
+      if (strcmp(value, "skip") == 0)
+        res.skip_tails = true;
+    }
+    if (strcmp(key, "prefixed") == 0) {
+      if (strcmp(value, "all") == 0)
+        res.prune_prefixes = false;
+      if (strcmp(value, "prune") == 0)
+        res.prune_prefixes = true;
+    }
+    if (strcmp(key, "same_exceptions") == 0)
+      parse_exception_pairs(value, res.exceptions);
+    if (strcmp(key, "flips") == 0) {
+      if (strcmp(value, "print") == 0)
+        res.exceptions.set_learning(false);
+      if (strcmp(value, "learn") == 0)
+        res.exceptions.set_learning(true);
+    }
+    if (strcmp(key, "benchmark") == 0)
+      res.benchmark = atoi(value);
+    if (strcmp(key, "output_flush") == 0)
+      res.output_flush = atoi(value);
+    if (strcmp(key, "output") == 0) {
+      if (strcmp(value, "text") == 0)
+        res.output = output_format::text;
+      if (strcmp(value, "binary") == 0)
+        res.output = output_format::binary;
+      if (strcmp(value, "ranges") == 0)
+        res.output = output_format::ranges;
+    }
+    if (strcmp(key, "serial_port") == 0)
+      res.serial.port = parse_hex(value);
+    if (strcmp(key, "serial_divisor") == 0)
+      res.serial.divisor = atoi(value);
+    if (strcmp(key, "serial_fifo") == 0)
+      res.serial.fifo_size = atoi(value);
+    if (strcmp(key, "serial_irq") == 0)
+      res.serial.irq = atoi(value);
+    if (strcmp(key, "compress") == 0) {
+      if (strcmp(value, "none") == 0)
+        res.compress_output = false;
+      if (strcmp(value, "lz") == 0)
+        res.compress_output = true;
+    }
+    if (strcmp(key, "cpus") == 0)
+      res.cpus = atoi(value);
+    if (strcmp(key, "start") == 0)
+      res.range.start = parse_bytes(value);
+    if (strcmp(key, "end") == 0)
+      res.range.end = parse_bytes(value);
+    if (strcmp(key, "shard") == 0) {
+      // shard=i/n selects the i-th of n parts, counting from zero.
+      size_t const slash = strcspn(value, "/");
+      size_t const shard = atoi(value);
+      size_t const shards = value[slash] ? atoi(value + slash + 1) : 0;
+
+      if (shard < shards) {
+        res.shard = shard;
+        res.shards = shards;
+      }
+    }
+    if (strcmp(key, "mode") == 0) {
+      if (strcmp(value, "search") == 0)
+        res.mode = search_mode::search;
+      if (strcmp(value, "random") == 0)
+        res.mode = search_mode::random;
+      if (strcmp(value, "vex") == 0)
+        res.mode = search_mode::vex;
+    }
+    if (strcmp(key, "schedule") == 0) {
+      if (strcmp(value, "order") == 0)
+        res.schedule_by_yield = false;
+      if (strcmp(value, "yield") == 0)
+        res.schedule_by_yield = true;
+    }
+    if (strcmp(key, "queue") == 0)
+      res.queue_port = parse_hex(value);
+    if (strcmp(key, "seed") == 0)
+      res.seed = parse_hex(value);
+    if (strcmp(key, "fixed") == 0)
+      res.fixed = parse_bytes(value);
+    if (strcmp(key, "mask") == 0)
+      res.mask = parse_bytes(value);
+    if (strcmp(key, "checkpoint") == 0)
+      res.checkpoint = atoi(value);
+    if (strcmp(key, "checkpoint_seconds") == 0)
+      res.checkpoint_seconds = atoi(value);
+    if (strcmp(key, "resume") == 0 and res.resume_count < max_resumes)
+      parsed_resumes[res.resume_count++] = parse_resume(value);
   }
 
   return res;
 }
 
-void start(cpu_features const &features, char *cmdline)
+// Print an instruction as text, as a binary record or as part of a range.
+static void report_instruction(options const &options, instruction_bytes const &instr,
+                               execution_attempt const &attempt)
 {
-  print_logo();
+  switch (options.output) {
+  case output_format::text:
+    print_instruction(instr, attempt);
+    break;
+  case output_format::binary:
+    print_record(instr, attempt);
+    break;
+  case output_format::ranges:
+    print_range(instr, attempt);
+    break;
+  }
+}
 
-  auto options = parse_and_destroy_cmdline(cmdline);
-  const auto sig = get_cpu_signature();
-  format(">>> CPU is ", sig.vendor, " ", hex(sig.signature, 8, false), ".\n");
+// Print what parse_resume() reads.
+static void print_resume(work_item const &work)
+{
+  format(" resume=");
+  print_compact_bytes(work.position.current);
+  format(",", hex(work.position.increment_at, 0, false),
+         ",", hex(work.last_attempt.exception, 0, false),
+         ",", hex(work.last_attempt.length, 0, false), ",");
+  print_compact_bytes(work.range.end);
 
-  format(">>> Executing self test.\n");
-  self_test_instruction_length(features);
+  auto const &exceptions = work.exceptions;
 
-  format(">>> Probing instruction space with up to ", options.prefixes,
-         " legacy prefix", options.prefixes == 1 ? "" : "es",
-         ".\n");
-  if (options.stop_after)
-    format(">>> Stopping after ", options.stop_after, " execution attemps.\n");
+  format(",", hex(exceptions.before_last.exception, 0, false),
+         ",", hex(exceptions.before_last.length, 0, false), ",");
+
+  for (size_t i = 0; i < exceptions.learned_count; i++) {
+    auto const &pair = exceptions.learned[i];
+
+    format(i ? "+" : "", hex(pair.a, 0, false), ":", hex(pair.b, 0, false), ":",
+           hex(pair.at, 0, false));
+  }
+}
+
+// Print the options that change what the search does or how its output looks,
+// so a restart from a checkpoint continues the same search.
+static void print_search_options(options const &options)
+{
+  static const char *probe_names[] { "linear", "binary", "infer", "batch", "verify" };
+  static const char *output_names[] { "text", "binary", "ranges" };
+
+  format(" prefixes=", options.prefixes,
+         " used_prefixes=", options.used_prefixes,
+         " detect_prefixes=", options.detect_prefixes,
+         " probe=", probe_names[static_cast<size_t>(options.probe)],
+         " modrm=", options.modrm_classes ? "classes" : "all",
+         " tails=", options.skip_tails ? "skip" : "all",
+         " prefixed=", options.prune_prefixes ? "prune" : "all",
+         " same_exceptions=");
+
+  bool any = false;
+
+  for (unsigned a = 0; a < 32; a++) {
+    for (unsigned b = a; b < 32; b++) {
+      if (options.exceptions.is_same(a, b)) {
+        format(any ? "," : "", hex(a, 0, false), ":", hex(b, 0, false));
+        any = true;
+      }
+    }
+  }
+
+  format(any ? "" : "none",
+         " flips=", options.exceptions.is_learning() ? "learn" : "print",
+         " output=", output_names[static_cast<size_t>(options.output)],
+         " compress=", options.compress_output ? "lz" : "none",
+         " output_flush=", options.output_flush,
+         " serial_port=", hex(options.serial.port, 0, false),
+         " serial_divisor=", options.serial.divisor,
+         " serial_fifo=", options.serial.fifo_size,
+         " serial_irq=", options.serial.irq,
+         " checkpoint=", options.checkpoint,
+         " checkpoint_seconds=", options.checkpoint_seconds);
+}
+
+// How the boot CPU tells the application processors what to do. See ap_start().
+// All CPUs do their work items in rounds. There is one round for each range
+// from the work queue and a single one otherwise.
+static options sift_options;
+static work_item sift_work[max_resumes];
+static size_t sift_work_count = 0;
+static size_t sift_cpus = 1;
+static size_t sift_rounds = 0;
+static bool sift_stop = false;
+static size_t sift_done = 0;
+
+// How many candidates all CPUs took from stop_after. See take_candidate().
+static size_t sift_candidates = 0;
+
+// Take a candidate from stop_after, which all CPUs share. Returns false, if
+// there are none left.
+static bool take_candidate(options const &options)
+{
+  return options.stop_after == 0 or
+    __atomic_fetch_add(&sift_candidates, 1, __ATOMIC_RELAXED) < options.stop_after;
+}
+
+// Returns true, if all CPUs together have executed stop_after candidates.
+static bool out_of_candidates(options const &options)
+{
+  return options.stop_after and
+    __atomic_load_n(&sift_candidates, __ATOMIC_RELAXED) >= options.stop_after;
+}
+
+// Print everything that is needed to continue the search of this CPU after the
+// current candidate. A restart with the options of the line continues exactly
+// where we are now without repeating any output.
+static void print_checkpoint(options const &options, size_t item, search_position const &position,
+                             execution_attempt const &last_attempt, exception_memory const &exceptions)
+{
+  work_item now;
+
+  now.resume = true;
+  now.position = position;
+  now.last_attempt = last_attempt;
+  now.exceptions = exceptions;
+  now.range.end = sift_work[item].range.end;
+
+  format(">>> Checkpoint of CPU ", cpu_index(), ":");
+  print_search_options(options);
+  print_resume(now);
+
+  // Work items that we haven't started yet are all from checkpoints as well.
+  // See sift_on_all_cpus.
+  for (size_t i = item + sift_cpus; i < sift_work_count; i += sift_cpus)
+    print_resume(sift_work[i]);
+
+  format("\n");
+}
+
+// What a CPU did with a work item.
+struct sift_result {
+  size_t executions = 0;
+  size_t found = 0;
+
+  // False, if we stopped early. Then the work item says where to continue.
+  bool done = true;
+};
+
+// Search a part of the instruction space and print all interesting
+// instructions. The first candidate of a fresh range is always interesting.
+// Stops after executing slice candidates, unless it is zero, and when all CPUs
+// together have executed stop_after candidates.
+template <int PREFIXES>
+static sift_result sift_with(cpu_features const &features, options const &options, size_t item,
+                             size_t slice)
+{
+  auto &work = sift_work[item];
+  sift_result result;
+  basic_search_engine<PREFIXES> search { options.prefixes, options.used_prefixes, options.detect_prefixes,
+                                         work.range };
+  execution_attempt last_attempt = work.last_attempt;
+  incomplete_prefix_memo memo;
+  byte_roles roles { features, options.probe, options.modrm_classes, options.skip_tails };
+  bool const use_roles = options.modrm_classes or options.skip_tails;
+  prefix_pruning pruning { features, options.probe };
+  exception_equivalence exceptions = options.exceptions;
 
-  search_engine search { options.prefixes, options.used_prefixes, options.detect_prefixes };
-  execution_attempt last_attempt;
+  uint64_t const checkpoint_cycles = options.checkpoint_seconds * get_tsc_frequency();
+  uint64_t last_checkpoint = rdtsc();
+  size_t candidates = 0;
+
+  if (work.resume) {
+    if (last_attempt.length == 0) {
+      instruction_bytes last = work.position.current;
+
+      if (not take_candidate(options)) {
+        result.done = false;
+        return result;
+      }
+
+      for (size_t i = work.position.increment_at + 1; i < sizeof(last.raw); i++)
+        last.raw[i] = 0xFF;
+
+      last_attempt = find_instruction_length(features, options.probe, last);
+      result.executions++;
+    }
+
+    exceptions.restore(work.exceptions);
+    search.set_position(work.position);
+    if (not search.find_next_candidate())
+      return result;
+  } else if (not search.find_first_candidate()) {
+    return result;
+  }
 
   do {
+    // Skip candidates that behave like others that we know about, together
+    // with everything that starts with them.
+    for (;;) {
+      auto const &candidate = search.get_candidate();
+      size_t const pos = search.get_position().increment_at;
+
+      if (options.prune_prefixes and pruning.is_redundant(candidate, pos, search.prefix_length())) {
+        search.clear_after(pos + 1);
+        search.start_over(pos + 1);
+      } else if (use_roles and roles.is_redundant(candidate, pos)) {
+        if (roles.role_of(candidate, pos) == byte_role::payload) {
+          search.skip_remaining();
+        } else {
+          search.clear_after(pos + 1);
+          search.start_over(pos + 1);
+        }
+      } else {
+        break;
+      }
+
+      if (not search.find_next_candidate())
+        return result;
+    }
+
+    // The whole run ends here, so it doesn't matter where the work item
+    // would continue.
+    if (not take_candidate(options)) {
+      result.done = false;
+      break;
+    }
+
     auto const &candidate = search.get_candidate();
-    auto attempt = find_instruction_length(features, candidate);
+    auto attempt = find_instruction_length(features, options.probe, candidate,
+                                           memo.known_incomplete(candidate));
+
+    memo.remember(candidate, attempt);
+    result.executions++;
+
+    size_t const pos = search.get_position().increment_at;
 
     search.clear_after(attempt.length);
 
-    if (is_interesting_change(last_attempt, attempt)) {
+    if (exceptions.is_interesting_change(last_attempt, attempt, candidate, pos)) {
       search.start_over(attempt.length);
+      result.found++;
 
       if (attempt.length <= sizeof(candidate.raw))
-        print_instruction(candidate, attempt);
+        report_instruction(options, candidate, attempt);
     }
 
     last_attempt = attempt;
-  } while (--options.stop_after > 0 && search.find_next_candidate());
+
+    if ((options.checkpoint and ++candidates % options.checkpoint == 0) or
+        (checkpoint_cycles and rdtsc() - last_checkpoint >= checkpoint_cycles)) {
+      print_checkpoint(options, item, search.get_position(), last_attempt,
+                       exceptions.memory(candidate));
+      last_checkpoint = rdtsc();
+    }
+
+    // The boot CPU prints what the other CPUs found.
+    if (cpu_index() == 0)
+      drain_output_buffers();
+
+    if (result.executions == slice) {
+      work.resume = true;
+      work.position = search.get_position();
+      work.last_attempt = last_attempt;
+      work.exceptions = exceptions.memory(candidate);
+      result.done = false;
+      break;
+    }
+  } while (search.find_next_candidate());
+
+  return result;
+}
+
+// Execute random candidates and print all of them. Each work item draws from
+// its own seed, so the same options and number of CPUs print the same
+// candidates, unless stop_after cuts them short.
+template <int PREFIXES>
+static sift_result sample_with(cpu_features const &features, options const &options, size_t item,
+                               size_t slice)
+{
+  basic_random_search<PREFIXES> search { options.seed + item, options.prefixes, options.used_prefixes,
+                                         options.detect_prefixes, options.fixed, options.mask };
+  sift_result result;
+
+  while (result.executions != slice and take_candidate(options)) {
+    auto const &candidate = search.next_candidate();
+
+    report_instruction(options, candidate, find_instruction_length(features, options.probe, candidate));
+    result.executions++;
+
+    // The boot CPU prints what the other CPUs found.
+    if (cpu_index() == 0)
+      drain_output_buffers();
+  }
+
+  result.found = result.executions;
+  return result;
+}
+
+template <int PREFIXES>
+static sift_result sift_or_sample_with(cpu_features const &features, options const &options, size_t item,
+                                       size_t slice)
+{
+  if (options.mode == search_mode::random)
+    return sample_with<PREFIXES>(features, options, item, slice);
+  else
+    return sift_with<PREFIXES>(features, options, item, slice);
+}
+
+// Pick the search engine that is specialized for the options, if there is one.
+static sift_result sift(cpu_features const &features, options const &options, size_t item,
+                        size_t slice)
+{
+  auto const specialized = [&options] (int prefixes) {
+    return has_specialized_search(prefixes, options.prefixes, options.used_prefixes,
+                                  options.detect_prefixes);
+  };
+
+  if (specialized(0))
+    return sift_or_sample_with<0>(features, options, item, slice);
+  else if (specialized(1))
+    return sift_or_sample_with<1>(features, options, item, slice);
+  else if (specialized(2))
+    return sift_or_sample_with<2>(features, options, item, slice);
+  else
+    return sift_or_sample_with<configured_prefixes>(features, options, item, slice);
+}
+
+// Take subtrees from the schedule and search a slice of each of them, until
+// they are all done.
+static void sift_by_yield(cpu_features const &features)
+{
+  auto &work = sift_work[cpu_index()];
+  size_t id;
+
+  while (not is_schedule_done() and not out_of_candidates(sift_options)) {
+    if (not take_subtree(id, work)) {
+      // Other CPUs have the rest. They may still split theirs.
+      if (cpu_index() == 0)
+        drain_output_buffers();
+      pause();
+      continue;
+    }
+
+    auto const result = sift(features, sift_options, cpu_index(), subtree_slice);
+
+    return_subtree(id, work, result.executions, result.found, result.done);
+  }
+}
+
+// Do all work items of the current CPU.
+static void sift_all_work(cpu_features const &features)
+{
+  if (sift_options.mode == search_mode::vex) {
+    // Every CPU takes every sift_cpus-th prefix of our shard and searches it
+    // in its own work item.
+    size_t const stride = sift_options.shards * sift_cpus;
+
+    for (size_t i = sift_options.shard + sift_options.shards * cpu_index(); i < vex_prefix_count(); i += stride) {
+      sift_work[cpu_index()] = {};
+      sift_work[cpu_index()].range = vex_prefix_range(i);
+      sift(features, sift_options, cpu_index(), 0);
+    }
+  } else if (sift_options.schedule_by_yield) {
+    sift_by_yield(features);
+  } else {
+    for (size_t i = cpu_index(); i < sift_work_count; i += sift_cpus)
+      sift(features, sift_options, i, 0);
+  }
+
+  flush_records();
+  flush_ranges();
+
+  if (sift_options.checkpoint or sift_options.checkpoint_seconds)
+    format(">>> Checkpoint of CPU ", cpu_index(), ": done.\n");
+}
+
+// Give each CPU its own part of the range or put it into the subtree schedule.
+static void hand_out(search_estimate const &estimate, search_range const &range)
+{
+  if (sift_options.schedule_by_yield) {
+    start_subtree_schedule(range);
+    return;
+  }
+
+  sift_work_count = sift_cpus;
+  for (size_t cpu = 0; cpu < sift_cpus; cpu++) {
+    sift_work[cpu] = {};
+    sift_work[cpu].range = estimate.split(range, cpu, sift_cpus);
+  }
+}
+
+// Let all CPUs do their work items and wait until they are done.
+static void sift_round(cpu_features const &features)
+{
+  size_t const round = sift_rounds + 1;
+
+  __atomic_store_n(&sift_rounds, round, __ATOMIC_RELEASE);
+
+  sift_all_work(features);
+
+  while (__atomic_load_n(&sift_done, __ATOMIC_ACQUIRE) < round * (sift_cpus - 1)) {
+    drain_output_buffers();
+    pause();
+  }
+  drain_output_buffers();
+}
+
+// Search the instruction space on as many CPUs as requested.
+static void sift_on_all_cpus(cpu_features const &features, options const &options)
+{
+  // Legacy prefixes would go in front of the VEX prefixes, so they are not
+  // searched with them.
+  if (options.mode != search_mode::vex)
+    format(">>> Probing instruction space with up to ", options.prefixes,
+           " legacy prefix", options.prefixes == 1 ? "" : "es",
+           ".\n");
+  if (options.stop_after)
+    format(">>> Stopping after ", options.stop_after, " candidates.\n");
+  if (options.output == output_format::binary)
+    format(">>> Printing instructions as binary records.\n");
+  if (options.output == output_format::ranges)
+    format(">>> Printing ranges of instructions.\n");
+
+  search_estimate const estimate { options.prefixes, options.used_prefixes,
+                                   options.detect_prefixes };
+  auto const range = estimate.split(options.range, options.shard, options.shards);
+
+  // Only the walk of a range has subtrees to schedule and can take its ranges
+  // from the work queue.
+  bool const by_yield = options.schedule_by_yield and options.mode == search_mode::search;
+  bool const by_queue = options.queue_port and options.mode == search_mode::search;
+
+  if (options.mode == search_mode::random)
+    format(">>> Sampling random candidates with seed ", hex(options.seed, 0, false), ".\n");
+  else if (options.mode == search_mode::vex)
+    format(">>> Searching shard ", options.shard, "/", options.shards, " of ", vex_prefix_count(),
+           " VEX, XOP and EVEX prefixes.\n");
+  else if (by_queue)
+    format(">>> Taking ranges from the work queue on port ", hex(options.queue_port, 0, false), ".\n");
+  else if (options.resume_count and not by_yield)
+    format(">>> Resuming from ", options.resume_count, " checkpoint",
+           options.resume_count == 1 ? "" : "s", ".\n");
+  else {
+    format(">>> Searching shard ", options.shard, "/", options.shards, " from ");
+    print_bytes(range.start, "the start");
+    format(" to ");
+    print_bytes(range.end, "the end");
+    format(".\n");
+  }
+  if (by_yield)
+    format(">>> Searching the subtrees with the best yield first.\n");
+
+  size_t const cpus = start_application_processors(options.cpus);
+  if (cpus > 1)
+    format(">>> Searching on ", cpus, " CPUs.\n");
+
+  sift_options = options;
+  sift_options.schedule_by_yield = by_yield;
+  sift_cpus = cpus;
+
+  // Checkpoints only describe where a walk of a range is, so they only work
+  // for the plain search. The work queue hands out ranges again, if they are
+  // not done.
+  if (options.mode != search_mode::search or by_yield or by_queue) {
+    sift_options.checkpoint = 0;
+    sift_options.checkpoint_seconds = 0;
+  }
+
+  if (options.mode == search_mode::vex)
+    sift_options.prefixes = 0;
+  start_output_buffering();
+
+  if (by_queue) {
+    search_range queued;
+
+    start_work_queue(options.queue_port);
+
+    while (next_queued_work(queued)) {
+      format(">>> Searching queued range from ");
+      print_bytes(queued.start, "the start");
+      format(" to ");
+      print_bytes(queued.end, "the end");
+      format(".\n");
+
+      hand_out(estimate, queued);
+      sift_round(features);
+
+      // The tool hands out ranges that we stopped in again.
+      if (out_of_candidates(sift_options))
+        break;
+
+      finish_queued_work(queued);
+    }
+  } else if (options.resume_count and options.mode == search_mode::search and not by_yield) {
+    // Each CPU continues from checkpoints.
+    sift_work_count = options.resume_count;
+    for (size_t i = 0; i < sift_work_count; i++)
+      sift_work[i] = parsed_resumes[i];
+
+    sift_round(features);
+  } else {
+    hand_out(estimate, range);
+    sift_round(features);
+  }
+
+  __atomic_store_n(&sift_stop, true, __ATOMIC_RELEASE);
+
+  auto const &stats = get_probe_statistics();
+  format(">>> Executed ", stats.executions, " times in user space, skipped ",
+         stats.skipped_executions, " linear-equivalent executions of known incomplete prefixes.\n");
+  if (options.probe == probe_mode::infer)
+    format(">>> Inferred ", stats.inferred, " lengths from the single-step trap.\n");
+
+  auto const &role_stats = get_byte_role_statistics();
+  if (options.modrm_classes)
+    format(">>> Skipped ", role_stats.redundant_candidates, " candidates in known ModRM and SIB classes.\n");
+  if (options.skip_tails)
+    format(">>> Skipped the remaining values of ", role_stats.payload_subtrees,
+           " immediate and displacement bytes.\n");
+  if (options.prune_prefixes)
+    format(">>> Skipped ", get_pruned_opcodes(), " prefixed opcodes that behave like without prefixes.\n");
+  if (by_yield)
+    format(">>> Split ", get_split_subtrees(), " subtrees of first bytes by their second bytes.\n");
+}
+
+// Wait until the boot CPU starts the given round. Returns false, if there are
+// no more rounds.
+static bool wait_for_round(size_t round)
+{
+  while (__atomic_load_n(&sift_rounds, __ATOMIC_ACQUIRE) < round) {
+    if (__atomic_load_n(&sift_stop, __ATOMIC_ACQUIRE))
+      return __atomic_load_n(&sift_rounds, __ATOMIC_ACQUIRE) >= round;
+
+    pause();
+  }
+
+  return true;
+}
+
+void ap_start(cpu_features const &features)
+{
+  if (not wait_for_round(1))
+    return;
+
+  // We came up too late to get a shard.
+  if (cpu_index() >= sift_cpus)
+    return;
+
+  if (needs_user_pages(sift_options.probe))
+    map_user_pages();
+
+  for (size_t round = 1; wait_for_round(round); round++) {
+    sift_all_work(features);
+
+    __atomic_add_fetch(&sift_done, 1, __ATOMIC_RELEASE);
+  }
+}
+
+void start(cpu_features const &features, char *cmdline)
+{
+  print_logo();
+
+  auto options = parse_and_destroy_cmdline(cmdline);
+  configure_output(options.serial);
+
+  if (options.compress_output) {
+    format(">>> Compressing output.\n");
+
+    // A single line doesn't compress well, so wait for a full buffer, unless
+    // we are told otherwise.
+    set_output_flush_size(options.output_flush ? options.output_flush : ~size_t(0));
+    set_output_compression(true);
+  } else {
+    set_output_flush_size(options.output_flush);
+  }
+
+  const auto sig = get_cpu_signature();
+  format(">>> CPU is ", sig.vendor, " ", hex(sig.signature, 8, false), ".\n");
+
+  if (needs_user_pages(options.probe))
+    map_user_pages();
+
+  format(">>> Executing self test.\n");
+  self_test_instruction_length(features, options.probe);
+  self_test_search_split();
+
+  if (options.benchmark)
+    run_benchmarks(features, options.probe, options.benchmark);
+  else
+    sift_on_all_cpus(features, options);
 
   format(">>> Done!\n");
+  finish_output();
 
   // Reset
   outbi<0x64>(0xFE);
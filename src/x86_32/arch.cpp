@@ -1,5 +1,6 @@
 #include "arch.hpp"
 #include "entry.hpp"
+#include "pic.hpp"
 #include "selectors.hpp"
 #include "util.hpp"
 #include "x86.hpp"
@@ -18,7 +19,7 @@ alignas(page_size) static uint32_t pdt[page_size / sizeof(uint32_t)];
 // Page table for user code.
 alignas(page_size) static uint32_t user_pt[page_size / sizeof(uint32_t)];
 
-alignas(page_size) static char user_page_backing[page_size];
+alignas(page_size) static char user_page_backing[user_page_count][page_size];
 
 static tss tss;
 
@@ -28,19 +29,57 @@ static void *ring0_continuation = nullptr;
 // The place where to store exception frames from user space.
 static exception_frame *ring3_exception_frame = nullptr;
 
-char *get_user_page_backing()
+// The state of a batched execution. These are used from entry.asm. While
+// batch_result is not null, user space exceptions are recorded there and
+// execution continues at the next address in the batch.
+extern "C" {
+  __attribute__((used)) uintptr_t const *batch_next = nullptr;
+  __attribute__((used)) uintptr_t const *batch_end = nullptr;
+  __attribute__((used)) user_exception *batch_result = nullptr;
+}
+
+static_assert(sizeof(user_exception) == 16, "entry.asm expects a different layout");
+
+char *get_user_page_backing(size_t index)
 {
-  return user_page_backing;
+  assert(index < user_page_count, "User page index out of range");
+  return user_page_backing[index];
 }
 
-uintptr_t get_user_page()
+uintptr_t get_user_page(size_t index)
 {
   // Needs to be in the reach of 16-bit code, so we don't need a different
   // mapping for 16-bit code. Don't use 1MB directly, because this will case the
   // sifting algorithm to find accidentally generate valid memory addresses and
   // needlessly enlarge the search space.
 
-  return (1UL << 20 /* MiB */) + page_size;
+  assert(index < user_page_count, "User page index out of range");
+  return (1UL << 20 /* MiB */) + page_size + 2 * index * page_size;
+}
+
+static void map_user_page(size_t index)
+{
+  user_pt[bit_select(22, 12, get_user_page(index))] =
+    reinterpret_cast<uintptr_t>(get_user_page_backing(index)) | PTE_U | PTE_P;
+}
+
+void map_user_pages()
+{
+  for (size_t i = 0; i < user_page_count; i++)
+    map_user_page(i);
+
+  // No TLB invalidation necessary, because we only created new entries. But we
+  // need to make sure the compiler actually writes the values.
+  asm volatile ("" ::: "memory");
+}
+
+void unmap_user_pages()
+{
+  for (size_t i = 1; i < user_page_count; i++)
+    user_pt[bit_select(22, 12, get_user_page(i))] = 0;
+
+  // The i386 has no INVLPG.
+  set_cr3(get_cr3());
 }
 
 static bool is_aligned(uint64_t v, int order)
@@ -102,9 +141,10 @@ static void setup_paging()
   // Map user page
   uintptr_t up = get_user_page();
 
-  assert(up + page_size <= istart, "User page cannot be mapped into kernel area");
+  assert(get_user_page(user_page_count - 1) + page_size <= istart,
+         "User page cannot be mapped into kernel area");
   pdt[bit_select(32, 22, up)] = reinterpret_cast<uintptr_t>(user_pt) | PTE_U | PTE_P;
-  user_pt[bit_select(22, 12, up)] = reinterpret_cast<uintptr_t>(get_user_page_backing()) | PTE_U | PTE_P;
+  map_user_page(0);
 
   if (pse_supported || has_smep()) //Enable either pse or smep and supported?
   {
@@ -158,6 +198,15 @@ static void print_exception(exception_frame const &ef)
 
 void irq_entry(exception_frame &ef)
 {
+  // User space runs with interrupts disabled, so IRQs always come from ring0.
+  // If one didn't, we would return to user space instead of stopping it. SS is
+  // only pushed for ring3, so we look at CS.
+  if (ef.vector >= pic_vector_base) {
+    assert((ef.cs & 3) == 0, "IRQ in user space");
+    handle_irq(ef.vector - pic_vector_base);
+    return;
+  }
+
   // We have to check CS here, because for kernel exceptions SS is not pushed.
   if ((ef.cs & 3) and ring0_continuation) {
     auto ret = ring0_continuation;
@@ -199,6 +248,11 @@ exception_frame execute_user(uintptr_t ip)
 
   ring3_exception_frame = &user;
 
+  // An interrupt must not arrive while the stack points to the user frame. We
+  // come back with interrupts disabled.
+  bool const interrupts = interrupts_enabled();
+  cli();
+
   // Prepare our stack to call irq_exit and exit to user space. We save a
   // continuation so we return here after an exception.
   //
@@ -221,9 +275,26 @@ exception_frame execute_user(uintptr_t ip)
        : "eax", "ecx", "edx", "ebx", "esi",
          "memory");
 
+  if (interrupts)
+    sti();
+
   return user;
 }
 
+void execute_user_batch(uintptr_t const *ips, user_exception *results, size_t count)
+{
+  if (count == 0)
+    return;
+
+  batch_next = ips + 1;
+  batch_end = ips + count;
+  batch_result = results;
+
+  // The last exception is recorded by entry.asm as well. It then clears
+  // batch_result and comes back here via irq_entry.
+  execute_user(ips[0]);
+}
+
 static void setup_idt()
 {
   static idt_desc idt[irq_entry_count];
@@ -238,12 +309,29 @@ static void setup_idt()
   lidt(idt);
 }
 
+void route_pic_interrupts()
+{
+  // We leave the local APIC alone in 32-bit mode. The firmware sets it up to
+  // pass the PIC through.
+}
+
+size_t start_application_processors(size_t)
+{
+  // We only sift on the boot CPU in 32-bit mode.
+  return 1;
+}
+
 extern "C" cpu_features const *setup_arch()
 {
   setup_paging();
   setup_gdt();
   setup_idt();
 
+  // The kernel is built without any FPU or SIMD code, so we can keep the FPU
+  // disabled all the time. User space gets #NM for every FPU, SSE or AVX
+  // instruction without us having to toggle CR0.TS on every transition.
+  set_cr0(get_cr0() | CR0_TS);
+
   static cpu_features features;
 
   // 32-bit x86 may not have NX.
@@ -3,8 +3,15 @@
 bits 32
 section .text
 extern irq_entry
+extern batch_next, batch_end, batch_result
 global irq_entry_start, irq_entry_end, irq_exit
 
+%define RING3_CODE_SELECTOR 0x23 ; see selectors.hpp
+%define RING3_DATA_SELECTOR 0x2b
+%define USER_EFLAGS 0x102        ; TF and the reserved bit
+
+%define USER_EXCEPTION_SIZE 16   ; see user_exception in arch.hpp
+
   ; Generate an interrupt entry function that takes care of normalizing the
   ; stack frame, i.e. pushes a dummy error code if the processor did not.
 %macro gen_entry 1-2 0          ; number has-error-code
@@ -21,12 +28,26 @@ irq_entry_%1:
 %endmacro
 
   ; Save the general-purpose registers and branch to the interrupt entry in C++.
+  ;
+  ; The FPU stays disabled via CR0.TS all the time, see setup_arch. So we
+  ; don't need to save or restore any FPU state here.
 save_context:
   cld
-  clts                          ; enable FPU
+  test byte [esp + 12], 3       ; CS of the exception frame
+  jz .save
+  push eax
+  mov eax, RING3_DATA_SELECTOR  ; Userspace might have destroyed these
+  mov ds, eax
+  mov es, eax
+  mov fs, eax
+  mov gs, eax
+  pop eax
+  cmp dword [batch_result], 0
+  jne batch_continue
+.save:
   pusha
 
-  mov eax, 0x2b                 ; Userspace might have destroyed these
+  mov eax, RING3_DATA_SELECTOR  ; Userspace might have destroyed these
   mov ds, eax
   mov es, eax
   mov fs, eax
@@ -35,13 +56,62 @@ save_context:
   mov eax, esp                  ; exception_frame
   call irq_entry
 irq_exit:
-  mov eax, cr0
-  or eax, (1 << 3)              ; disable FPU
-  mov cr0, eax
   popa
   add esp, 8                    ; error code / vector
   iret
 
+  ; Record a user space exception during a batched execution and directly go
+  ; back to user space with the next address in the batch. See
+  ; execute_user_batch. Once the batch is done, we return via irq_entry as
+  ; usual. The data segments were already reloaded in save_context.
+batch_continue:
+  push eax
+  push ecx
+
+  mov eax, [batch_result]
+  mov ecx, [esp + 8]            ; vector
+  mov [eax], ecx
+  mov ecx, [esp + 12]           ; error code
+  mov [eax + 4], ecx
+  mov ecx, cr2
+  mov [eax + 8], ecx
+  mov ecx, [esp + 16]           ; EIP
+  mov [eax + 12], ecx
+  add eax, USER_EXCEPTION_SIZE
+  mov [batch_result], eax
+
+  mov ecx, [batch_next]
+  cmp ecx, [batch_end]
+  je .done
+
+  mov eax, [ecx]
+  add ecx, 4
+  mov [batch_next], ecx
+
+  mov [esp + 16], eax           ; EIP
+  mov dword [esp + 20], RING3_CODE_SELECTOR
+  mov dword [esp + 24], USER_EFLAGS
+  mov dword [esp + 28], 0       ; ESP
+  mov dword [esp + 32], RING3_DATA_SELECTOR
+
+  ; Every execution starts with the same register state as with irq_exit.
+  xor eax, eax
+  xor ecx, ecx
+  xor edx, edx
+  xor ebx, ebx
+  xor ebp, ebp
+  xor esi, esi
+  xor edi, edi
+
+  add esp, 16                   ; EAX/ECX / error code / vector
+  iret
+
+.done:
+  mov dword [batch_result], 0
+  pop ecx
+  pop eax
+  jmp save_context.save
+
 irq_entry_start:
   gen_entry 0
   gen_entry 1
@@ -76,8 +146,26 @@ irq_entry_start:
   gen_entry 29, 1
   gen_entry 30, 1
   gen_entry 31
+
+  ; The IRQs of the PIC. See pic.hpp.
+  gen_entry 32
+  gen_entry 33
+  gen_entry 34
+  gen_entry 35
+  gen_entry 36
+  gen_entry 37
+  gen_entry 38
+  gen_entry 39
+  gen_entry 40
+  gen_entry 41
+  gen_entry 42
+  gen_entry 43
+  gen_entry 44
+  gen_entry 45
+  gen_entry 46
+  gen_entry 47
 irq_entry_end:
 
-%if (irq_entry_end - irq_entry_start) != (irq_entry_2 - irq_entry_1)*32
+%if (irq_entry_end - irq_entry_start) != (irq_entry_2 - irq_entry_1)*48
 %error "Interrupt entry function size is inconsistent."
 %endif
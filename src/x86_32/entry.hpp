@@ -2,8 +2,9 @@
 
 #include <cstddef>
 
-// Total number of interrupt handlers
-constexpr size_t irq_entry_count = 32;
+// Total number of interrupt handlers: the exceptions and the IRQs of the PIC.
+// See pic.hpp.
+constexpr size_t irq_entry_count = 48;
 
 // An array of interrupt entry functions
 extern "C" char irq_entry_start[];
@@ -24,17 +24,60 @@ struct exception_frame {
 
 const size_t page_size = 4096;
 
+// The number of user space pages. Each of them is followed by an unmapped page.
+// Only the first one is mapped by default. The others are for batched
+// executions, see map_user_pages().
+const size_t user_page_count = 16;
+
 // The user space page as a read-only user-accessible mapping.
-uintptr_t get_user_page();
+uintptr_t get_user_page(size_t index = 0);
 
 // The user space page as a read-write supervisor-accessible mapping.
-char *get_user_page_backing();
+char *get_user_page_backing(size_t index = 0);
+
+// Map all user space pages. Every mapped page is a valid memory operand for the
+// instructions we execute, so only do this when we actually need them.
+void map_user_pages();
+
+// Go back to only the first user space page being mapped.
+void unmap_user_pages();
 
 struct cpu_features;
 
 // The entry point that is called by the assembly bootstrap code.
 extern "C" void start(cpu_features const &features, char *cmdline);
 
+// The entry point for application processors.
+void ap_start(cpu_features const &features);
+
+// We only sift on multiple CPUs in 64-bit mode.
+const size_t max_cpus = 1;
+
+// Return the index of the CPU we are running on. The boot CPU has index 0.
+inline size_t cpu_index() { return 0; }
+
+// Start application processors until there are limit CPUs in total. Zero means
+// as many as there are. Each application processor calls ap_start() once it is
+// ready. Returns the number of CPUs that run, including the boot CPU.
+size_t start_application_processors(size_t limit);
+
+// Let the legacy PIC interrupt the boot CPU. See pic.
+void route_pic_interrupts();
+
 // Try to execute a single userspace instruction and return the exception that
 // resulted.
 exception_frame execute_user(uintptr_t rip);
+
+// What we record about each execution of a batch. The layout is known to
+// entry.asm.
+struct user_exception {
+  uint32_t vector;
+  uint32_t error_code;
+  uint32_t cr2;
+  uint32_t ip;
+};
+
+// Execute userspace instructions at each of the given addresses in turn and
+// record the resulting exceptions. In contrast to execute_user(), we only go
+// back to C++ code once the whole batch is done.
+void execute_user_batch(uintptr_t const *ips, user_exception *results, size_t count);
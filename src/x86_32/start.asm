@@ -1,7 +1,7 @@
   ; -*- Mode: nasm -*-
 
 %define PAGE_SIZE 4096
-%define MAX_CMDLINE_SIZE 256
+%define MAX_CMDLINE_SIZE 4096
 
 bits 32
 
@@ -2,32 +2,32 @@
 #include "avx.hpp"
 #include "entry.hpp"
 #include "paging.hpp"
+#include "pic.hpp"
 #include "selectors.hpp"
+#include "smp.hpp"
 #include "x86.hpp"
 #include "util.hpp"
 #include "cpu_features.hpp"
+#include "cpu_local.hpp"
 
 extern "C" void irq_entry(exception_frame &);
 
-// We only need interrupt descriptors for exceptions.
+// We only need interrupt descriptors for exceptions and the IRQs of the PIC. All
+// CPUs share them.
 static idt_desc idt[irq_entry_count];
-static tss tss;
-static gdt_desc gdt[6] {
-  {},
-  gdt_desc::kern_code64_desc(),
-  gdt_desc::kern_data64_desc(),
-  gdt_desc::tss_desc(&tss),
-  gdt_desc::user_code64_desc(),
-  gdt_desc::user_data64_desc(),
-};
-
-// The RIP where execution continues after a user space exception.
-static void *ring0_continuation = nullptr;
-
-// The place where to store exception frames from user space.
-static exception_frame *ring3_exception_frame = nullptr;
-
-void setup_idt()
+
+static_assert(sizeof(user_exception) == 32, "entry.asm expects a different layout");
+static_assert(__builtin_offsetof(cpu_local, batch_next) == 0 and
+              __builtin_offsetof(cpu_local, batch_end) == 8 and
+              __builtin_offsetof(cpu_local, batch_result) == 16,
+              "entry.asm expects a different layout");
+
+size_t cpu_index()
+{
+  return this_cpu().index;
+}
+
+static void setup_idt()
 {
   size_t entry_fn_size = (irq_entry_end - irq_entry_start) / irq_entry_count;
 
@@ -36,9 +36,23 @@ void setup_idt()
 				      reinterpret_cast<uint64_t>(irq_entry_start + i*entry_fn_size),
 				      0, 0);
   }
+}
+
+// Load the descriptor tables of the current CPU. Each CPU needs its own GDT,
+// because it needs its own TSS.
+static void setup_descriptors()
+{
+  auto &cpu = this_cpu();
+
+  cpu.gdt[0] = {};
+  cpu.gdt[1] = gdt_desc::kern_code64_desc();
+  cpu.gdt[2] = gdt_desc::kern_data64_desc();
+  cpu.gdt[3] = gdt_desc::tss_desc(&cpu.tss);
+  cpu.gdt[4] = gdt_desc::user_code64_desc();
+  cpu.gdt[5] = gdt_desc::user_data64_desc();
 
   // Load a new GDT that also includes a task gate.
-  lgdt(gdt);
+  lgdt(cpu.gdt);
 
   // Our selectors are already correct, because we use the same ones as in the
   // boot GDT.
@@ -61,18 +75,28 @@ static void print_exception(exception_frame const &ef)
 
 void irq_entry(exception_frame &ef)
 {
-  if ((ef.ss & 3) and ring0_continuation) {
-    auto ret = ring0_continuation;
-    ring0_continuation = nullptr;
+  auto &cpu = this_cpu();
+
+  // User space runs with interrupts disabled, so IRQs always come from ring0.
+  // If one didn't, we would return to user space instead of stopping it.
+  if (ef.vector >= pic_vector_base) {
+    assert((ef.ss & 3) == 0, "IRQ in user space");
+    handle_irq(ef.vector - pic_vector_base);
+    return;
+  }
 
-    if (ring3_exception_frame) {
-      *ring3_exception_frame = ef;
-      ring3_exception_frame = nullptr;
+  if ((ef.ss & 3) and cpu.ring0_continuation) {
+    auto ret = cpu.ring0_continuation;
+    cpu.ring0_continuation = nullptr;
+
+    if (cpu.ring3_exception_frame) {
+      *cpu.ring3_exception_frame = ef;
+      cpu.ring3_exception_frame = nullptr;
     }
 
     asm ("mov %0, %%rsp\n"
 	 "jmp *%1\n"
-	 :: "r" (tss.rsp[0]), "r" (ret) : "memory");
+	 :: "r" (cpu.tss.rsp[0]), "r" (ret) : "memory");
     __builtin_unreachable();
   }
 
@@ -85,7 +109,7 @@ void irq_entry(exception_frame &ef)
 // the details of the exception.
 exception_frame execute_user(uintptr_t rip)
 {
-  static uint64_t clobbered_rbp;
+  auto &cpu = this_cpu();
   exception_frame user {};
 
   user.cs = ring3_code_selector;
@@ -93,7 +117,12 @@ exception_frame execute_user(uintptr_t rip)
   user.ss = ring3_data_selector;
   user.rflags = (1 /* TF */ << 8) | 2;
 
-  ring3_exception_frame = &user;
+  cpu.ring3_exception_frame = &user;
+
+  // An interrupt must not arrive while the stack points to the user frame. We
+  // come back with interrupts disabled.
+  bool const interrupts = interrupts_enabled();
+  cli();
 
   // Prepare our stack to call irq_exit and exit to user space. We save a
   // continuation so we return here after an exception.
@@ -107,8 +136,8 @@ exception_frame execute_user(uintptr_t rip)
        "jmp irq_exit\n"
        "1:\n"
        "mov %[rbp_save], %%rbp\n"
-       : [ring0_rsp] "=m" (tss.rsp[0]), [cont] "=m" (ring0_continuation),
-	 [user] "+m" (user), [rbp_save] "=m" (clobbered_rbp)
+       : [ring0_rsp] "=m" (cpu.tss.rsp[0]), [cont] "=m" (cpu.ring0_continuation),
+	 [user] "+m" (user), [rbp_save] "=m" (cpu.clobbered_rbp)
        :
        // Everything except RBP is clobbered, because we come back via irq_entry
        // after basically executing random bytes.
@@ -116,19 +145,63 @@ exception_frame execute_user(uintptr_t rip)
 	 "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
 	 "memory");
 
+  if (interrupts)
+    sti();
+
   return user;
 }
 
+void execute_user_batch(uintptr_t const *ips, user_exception *results, size_t count)
+{
+  if (count == 0)
+    return;
+
+  auto &cpu = this_cpu();
+
+  cpu.batch_next = ips + 1;
+  cpu.batch_end = ips + count;
+  cpu.batch_result = results;
+
+  // The last exception is recorded by entry.asm as well. It then clears
+  // batch_result and comes back here via irq_entry.
+  execute_user(ips[0]);
+}
+
+static cpu_features features;
+
+// Setup everything that each CPU needs after paging is up.
+static void setup_cpu()
+{
+  setup_descriptors();
+
+  // The kernel is built without any FPU or SIMD code, so we can keep the FPU
+  // disabled all the time. User space gets #NM for every FPU, SSE or AVX
+  // instruction without us having to toggle CR0.TS on every transition.
+  set_cr0(get_cr0() | CR0_TS);
+}
+
 extern "C" cpu_features const *setup_arch()
 {
-  setup_idt();
+  // The descriptor tables live in CPU-local memory, so paging comes first.
   setup_paging();
+  setup_idt();
+  setup_cpu();
   try_setup_avx();
 
-  static cpu_features features;
-
   // 64-bit x86 always has support for NX.
   features.has_nx = true;
 
   return &features;
 }
+
+cpu_features const &ap_setup_arch(size_t index, uint64_t xcr0)
+{
+  setup_paging(index);
+  setup_cpu();
+
+  // Use the same extended state components as the boot CPU. CR4 was copied
+  // from the boot CPU by the startup code.
+  set_xcr0(xcr0);
+
+  return features;
+}
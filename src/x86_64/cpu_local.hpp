@@ -0,0 +1,40 @@
+#pragma once
+
+#include "arch.hpp"
+#include "x86.hpp"
+
+// Everything a CPU needs for itself. Each CPU has its own copy mapped at
+// cpu_local_address, so we don't need to find out which CPU we are running on
+// to access it. See paging.cpp.
+struct cpu_local {
+  // The state of a batched execution. These are used from entry.asm and have
+  // to stay at the beginning. While batch_result is not null, user space
+  // exceptions are recorded there and execution continues at the next address
+  // in the batch.
+  uintptr_t const *batch_next = nullptr;
+  uintptr_t const *batch_end = nullptr;
+  user_exception *batch_result = nullptr;
+
+  // The RIP where execution continues after a user space exception.
+  void *ring0_continuation = nullptr;
+
+  // The place where to store exception frames from user space.
+  exception_frame *ring3_exception_frame = nullptr;
+
+  // Where execute_user() keeps RBP while we are in user space.
+  uint64_t clobbered_rbp = 0;
+
+  // The index of this CPU. See cpu_index().
+  size_t index = 0;
+
+  struct tss tss {};
+  gdt_desc gdt[6];
+};
+
+// This is below 2GB, so the compiler can use absolute addresses.
+constexpr uintptr_t cpu_local_address = 1UL << 30;
+
+inline cpu_local &this_cpu()
+{
+  return *reinterpret_cast<cpu_local *>(cpu_local_address);
+}
@@ -5,6 +5,18 @@ section .text
 extern irq_entry
 global irq_entry_start, irq_entry_end, irq_exit
 
+%define RING3_CODE_SELECTOR 0x43 ; see selectors.hpp
+%define RING3_DATA_SELECTOR 0x53
+%define USER_RFLAGS 0x102        ; TF and the reserved bit
+
+%define USER_EXCEPTION_SIZE 32   ; see user_exception in arch.hpp
+
+  ; The batch state is at the beginning of the CPU-local data. See cpu_local.hpp.
+%define CPU_LOCAL 0x40000000
+%define BATCH_NEXT (CPU_LOCAL + 0)
+%define BATCH_END (CPU_LOCAL + 8)
+%define BATCH_RESULT (CPU_LOCAL + 16)
+
   ; Generate an interrupt entry function that takes care of normalizing the
   ; stack frame, i.e. pushes a dummy error code if the processor did not.
 %macro gen_entry 1-2 0          ; number has-error-code
@@ -21,9 +33,16 @@ irq_entry_%1:
 %endmacro
 
   ; Save the general-purpose registers and branch to the interrupt entry in C++.
+  ;
+  ; The FPU stays disabled via CR0.TS all the time, see setup_arch. So we
+  ; don't need to save or restore any FPU state here.
 save_context:
   cld
-  clts                          ; enable FPU
+  test byte [rsp + 24], 3       ; CS of the exception frame
+  jz .save
+  cmp qword [BATCH_RESULT], 0
+  jne batch_continue
+.save:
   push rax
   push rcx
   push rdx
@@ -44,9 +63,6 @@ save_context:
   lea rdi, [rsp]                ; exception_frame
   call irq_entry
 irq_exit:
-  mov rax, cr0
-  or rax, (1 << 3)            ; disable FPU
-  mov cr0, rax
   pop r15
   pop r14
   pop r13
@@ -66,6 +82,66 @@ irq_exit:
   add rsp, 16                   ; error code / vector
   iretq
 
+  ; Record a user space exception during a batched execution and directly go
+  ; back to user space with the next address in the batch. See
+  ; execute_user_batch. Once the batch is done, we return via irq_entry as
+  ; usual.
+batch_continue:
+  push rax
+  push rcx
+
+  mov rax, [BATCH_RESULT]
+  mov rcx, [rsp + 16]           ; vector
+  mov [rax], rcx
+  mov rcx, [rsp + 24]           ; error code
+  mov [rax + 8], rcx
+  mov rcx, cr2
+  mov [rax + 16], rcx
+  mov rcx, [rsp + 32]           ; RIP
+  mov [rax + 24], rcx
+  add rax, USER_EXCEPTION_SIZE
+  mov [BATCH_RESULT], rax
+
+  mov rcx, [BATCH_NEXT]
+  cmp rcx, [BATCH_END]
+  je .done
+
+  mov rax, [rcx]
+  add rcx, 8
+  mov [BATCH_NEXT], rcx
+
+  mov [rsp + 32], rax           ; RIP
+  mov qword [rsp + 40], RING3_CODE_SELECTOR
+  mov qword [rsp + 48], USER_RFLAGS
+  mov qword [rsp + 56], 0       ; RSP
+  mov qword [rsp + 64], RING3_DATA_SELECTOR
+
+  ; Every execution starts with the same register state as with irq_exit.
+  xor eax, eax
+  xor ecx, ecx
+  xor edx, edx
+  xor ebx, ebx
+  xor ebp, ebp
+  xor esi, esi
+  xor edi, edi
+  xor r8d, r8d
+  xor r9d, r9d
+  xor r10d, r10d
+  xor r11d, r11d
+  xor r12d, r12d
+  xor r13d, r13d
+  xor r14d, r14d
+  xor r15d, r15d
+
+  add rsp, 32                   ; RAX/RCX / error code / vector
+  iretq
+
+.done:
+  mov qword [BATCH_RESULT], 0
+  pop rcx
+  pop rax
+  jmp save_context.save
+
 irq_entry_start:
   gen_entry 0
   gen_entry 1
@@ -100,8 +176,26 @@ irq_entry_start:
   gen_entry 29, 1
   gen_entry 30, 1
   gen_entry 31
+
+  ; The IRQs of the PIC. See pic.hpp.
+  gen_entry 32
+  gen_entry 33
+  gen_entry 34
+  gen_entry 35
+  gen_entry 36
+  gen_entry 37
+  gen_entry 38
+  gen_entry 39
+  gen_entry 40
+  gen_entry 41
+  gen_entry 42
+  gen_entry 43
+  gen_entry 44
+  gen_entry 45
+  gen_entry 46
+  gen_entry 47
 irq_entry_end:
 
-%if (irq_entry_end - irq_entry_start) != (irq_entry_2 - irq_entry_1)*32
+%if (irq_entry_end - irq_entry_start) != (irq_entry_2 - irq_entry_1)*48
 %error "Interrupt entry function size is inconsistent."
 %endif
@@ -1,13 +1,20 @@
 #include "arch.hpp"
+#include "cpu_local.hpp"
 #include "paging.hpp"
+#include "smp.hpp"
 #include "util.hpp"
 #include "x86.hpp"
 
-extern char _image_end[];
+extern "C" char _image_start[];
+extern "C" char _image_end[];
 
-uintptr_t get_user_page()
+// How much of the kernel image start.asm maps.
+const size_t kernel_mapping_size = 8 << 20;
+
+uintptr_t get_user_page(size_t index)
 {
-  return (1UL << 32);
+  assert(index < user_page_count, "User page index out of range");
+  return (1UL << 32) + 2 * index * page_size;
 }
 
 // These are our boot page table structures, which are partly setup by the
@@ -20,27 +27,98 @@ alignas(page_size) uint64_t boot_pml4[512];
 alignas(page_size) uint64_t boot_pdpt[512]; // Covers 0 - 512GB
 alignas(page_size) uint64_t boot_pd[512];   // Covers 0 - 1GB
 
-alignas(page_size) static uint64_t user_pd[512]; // Covers 4GB-5GB
-alignas(page_size) static uint64_t user_pt[512]; // Covers 4GB to 4GB+4K
+alignas(page_size) static uint64_t apic_pd[512]; // Covers 3GB-4GB
+
+// The page tables of a single CPU. Each CPU shares the kernel mapping of the
+// boot page tables, but has its own user pages and its own cpu_local.
+struct alignas(page_size) cpu_page_tables {
+  alignas(page_size) uint64_t pml4[512];
+  alignas(page_size) uint64_t pdpt[512];     // Covers 0 - 512GB
+  alignas(page_size) uint64_t local_pd[512]; // Covers 1GB-2GB
+  alignas(page_size) uint64_t local_pt[512]; // Covers 1GB to 1GB+2MB
+  alignas(page_size) uint64_t user_pd[512];  // Covers 4GB-5GB
+  alignas(page_size) uint64_t user_pt[512];  // Covers 4GB to 4GB+2MB
 
-alignas(page_size) static char user_page_backing[page_size];
+  alignas(page_size) cpu_local local;
+  alignas(page_size) char user_page_backing[user_page_count][page_size];
+};
 
-char *get_user_page_backing()
+static cpu_page_tables per_cpu_tables[max_cpus];
+
+char *get_user_page_backing(size_t index)
 {
-  return user_page_backing;
+  assert(index < user_page_count, "User page index out of range");
+  return per_cpu_tables[cpu_index()].user_page_backing[index];
 }
 
-void setup_paging()
+static void map_user_page(cpu_page_tables &pt, size_t index)
 {
-  const uintptr_t up = get_user_page();
+  pt.user_pt[bit_select(21, 12, get_user_page(index))] =
+    (uintptr_t)pt.user_page_backing[index] | PTE_P | PTE_U;
+}
 
-  assert((boot_pml4[bit_select(48, 39, up)] & ~0xFFF) == (uintptr_t)boot_pdpt, "PML4 is broken");
+void map_user_pages()
+{
+  auto &pt = per_cpu_tables[cpu_index()];
 
-  boot_pdpt[bit_select(39, 30, up)] = (uintptr_t)user_pd | PTE_P | PTE_U;
-  user_pd[bit_select(30, 21, up)] = (uintptr_t)user_pt | PTE_P | PTE_U;
-  user_pt[bit_select(21, 12, up)] = (uintptr_t)get_user_page_backing() | PTE_P | PTE_U;
+  for (size_t i = 0; i < user_page_count; i++)
+    map_user_page(pt, i);
 
-  // No TLB invalidation necessary, because we only created new entries. But we
-  // need to make sure the compiler actually writes the values.
+  // See setup_paging.
   asm volatile ("" ::: "memory");
 }
+
+void unmap_user_pages()
+{
+  auto &pt = per_cpu_tables[cpu_index()];
+
+  for (size_t i = 1; i < user_page_count; i++) {
+    pt.user_pt[bit_select(21, 12, get_user_page(i))] = 0;
+    asm volatile ("invlpg (%0)" :: "r" (get_user_page(i)) : "memory");
+  }
+}
+
+void set_low_memory_mapping(bool mapped)
+{
+  boot_pd[0] = mapped ? (0 | PTE_P | PTE_W | PTE_PS) : 0;
+  asm volatile ("invlpg (%0)" :: "r" (0UL) : "memory");
+}
+
+void setup_paging(size_t cpu)
+{
+  assert(cpu < max_cpus, "CPU index out of range");
+
+  auto &pt = per_cpu_tables[cpu];
+  const uintptr_t up = get_user_page();
+  const uintptr_t local = cpu_local_address;
+
+  // Everything below 4GB except the CPU-local data is shared.
+  pt.pml4[0] = (uintptr_t)pt.pdpt | PTE_P | PTE_W | PTE_U;
+  for (size_t i = 0; i < 4; i++)
+    pt.pdpt[i] = boot_pdpt[i];
+
+  pt.pdpt[bit_select(39, 30, local)] = (uintptr_t)pt.local_pd | PTE_P | PTE_W;
+  pt.local_pd[bit_select(30, 21, local)] = (uintptr_t)pt.local_pt | PTE_P | PTE_W;
+  pt.local_pt[bit_select(21, 12, local)] = (uintptr_t)&pt.local | PTE_P | PTE_W;
+  pt.local.index = cpu;
+
+  pt.pdpt[bit_select(39, 30, up)] = (uintptr_t)pt.user_pd | PTE_P | PTE_U;
+  pt.user_pd[bit_select(30, 21, up)] = (uintptr_t)pt.user_pt | PTE_P | PTE_U;
+  map_user_page(pt, 0);
+
+  set_cr3((uintptr_t)pt.pml4);
+}
+
+void setup_paging()
+{
+  assert((boot_pml4[0] & ~0xFFF) == (uintptr_t)boot_pdpt, "PML4 is broken");
+  assert((size_t)(_image_end - _image_start) <= kernel_mapping_size, "Kernel image is too large");
+
+  // The local APIC is uncached memory. We only need it to start application
+  // processors.
+  boot_pdpt[bit_select(39, 30, local_apic_address)] = (uintptr_t)apic_pd | PTE_P | PTE_W;
+  apic_pd[bit_select(30, 21, local_apic_address)] =
+    (local_apic_address & ~((1UL << 21) - 1)) | PTE_P | PTE_W | PTE_PS | PTE_PWT | PTE_PCD;
+
+  setup_paging(0);
+}
@@ -1,3 +1,14 @@
 #pragma once
 
+#include <cstddef>
+
+// Setup the page tables of the boot CPU.
 void setup_paging();
+
+// Setup the page tables of the given CPU and switch to them. Afterwards,
+// this_cpu() is accessible.
+void setup_paging(size_t cpu);
+
+// Identity map the first 2MB of physical memory. Application processors start
+// there.
+void set_low_memory_mapping(bool mapped);
@@ -0,0 +1,152 @@
+#include <cstring>
+
+#include "arch.hpp"
+#include "cpuid.hpp"
+#include "msr.hpp"
+#include "paging.hpp"
+#include "smp.hpp"
+#include "timer.hpp"
+#include "util.hpp"
+#include "x86.hpp"
+
+// Application processors start in real mode at this address. It has to match
+// TRAMPOLINE_BASE in trampoline.asm.
+const uintptr_t trampoline_address = 0x8000;
+
+// The stack size of application processors. It has to match AP_STACK_SIZE in
+// trampoline.asm.
+const size_t ap_stack_size = 4 * page_size;
+
+extern "C" char ap_trampoline_start[];
+extern "C" char ap_trampoline_end[];
+
+// These are used by trampoline.asm.
+extern "C" {
+  __attribute__((used)) uint32_t ap_boot_cr3;
+  __attribute__((used)) uint32_t ap_boot_cr4;
+
+  // The index the next application processor gets. Application processors
+  // that get an index of ap_index_limit or above stop immediately.
+  __attribute__((used)) uint32_t ap_next_index = 1;
+  __attribute__((used)) uint32_t ap_index_limit;
+
+  // The boot CPU doesn't use its entry.
+  alignas(16) __attribute__((used)) char ap_stacks[max_cpus][ap_stack_size];
+}
+
+static uint64_t boot_xcr0;
+
+// The number of CPUs that are done with their setup, including the boot CPU.
+static uint32_t cpus_online = 1;
+
+enum : uint32_t {
+  APIC_SVR = 0xF0,
+  APIC_ICR_LO = 0x300,
+  APIC_ICR_HI = 0x310,
+  APIC_LVT_LINT0 = 0x350,
+};
+
+enum : uint32_t {
+  APIC_SVR_ENABLE = 1 << 8,
+
+  APIC_LVT_EXTINT = 7 << 8,
+
+  APIC_ICR_INIT = 5 << 8,
+  APIC_ICR_STARTUP = 6 << 8,
+  APIC_ICR_PENDING = 1 << 12,
+  APIC_ICR_ASSERT = 1 << 14,
+  APIC_ICR_ALL_BUT_SELF = 3 << 18,
+};
+
+static uint32_t read_apic(uint32_t reg)
+{
+  return *reinterpret_cast<uint32_t volatile *>(local_apic_address + reg);
+}
+
+static void write_apic(uint32_t reg, uint32_t value)
+{
+  *reinterpret_cast<uint32_t volatile *>(local_apic_address + reg) = value;
+}
+
+// Send an IPI to all CPUs except ourselves and wait until it is delivered.
+static void send_ipi_to_others(uint32_t icr)
+{
+  write_apic(APIC_ICR_HI, 0);
+  write_apic(APIC_ICR_LO, icr | APIC_ICR_ASSERT | APIC_ICR_ALL_BUT_SELF);
+
+  while (read_apic(APIC_ICR_LO) & APIC_ICR_PENDING)
+    pause();
+}
+
+// Returns true, if the local APIC is where we expect it and usable via MMIO.
+static bool has_usable_apic()
+{
+  if (not has_apic())
+    return false;
+
+  uint64_t const apic_base = rdmsr(IA32_APIC_BASE);
+
+  return (apic_base & (IA32_APIC_BASE_EN | IA32_APIC_BASE_EXTD)) == IA32_APIC_BASE_EN
+    and (apic_base & 0xFFFFFF000) == local_apic_address;
+}
+
+void route_pic_interrupts()
+{
+  // Without a usable local APIC, the PIC interrupts the CPU directly.
+  if (not has_usable_apic())
+    return;
+
+  // The PIC is connected to LINT0 of the boot CPU. Firmware usually sets this
+  // up, but we don't depend on it.
+  write_apic(APIC_LVT_LINT0, APIC_LVT_EXTINT);
+  write_apic(APIC_SVR, read_apic(APIC_SVR) | APIC_SVR_ENABLE);
+}
+
+size_t start_application_processors(size_t limit)
+{
+  if (limit == 0 or limit > max_cpus)
+    limit = max_cpus;
+
+  if (limit == 1 or not has_usable_apic())
+    return 1;
+
+  // Application processors come up with the same control registers as the boot
+  // CPU. Our page tables are below 4GB, so they are usable from 32-bit code.
+  ap_boot_cr3 = (uint32_t)get_cr3();
+  ap_boot_cr4 = (uint32_t)get_cr4();
+  boot_xcr0 = get_xcr0();
+  ap_index_limit = limit;
+
+  set_low_memory_mapping(true);
+  memcpy(reinterpret_cast<void *>(trampoline_address), ap_trampoline_start,
+         ap_trampoline_end - ap_trampoline_start);
+
+  write_apic(APIC_SVR, read_apic(APIC_SVR) | APIC_SVR_ENABLE);
+
+  // See Intel SDM Vol. 3 Chapter 8.4.4.1 "Typical BSP Initialization
+  // Sequence". We don't know how many CPUs there are, so we broadcast.
+  send_ipi_to_others(APIC_ICR_INIT);
+  delay_us(10000);
+
+  for (size_t i = 0; i < 2; i++) {
+    send_ipi_to_others(APIC_ICR_STARTUP | (trampoline_address >> 12));
+    delay_us(200);
+  }
+
+  // Give all application processors time to leave the trampoline.
+  delay_us(100000);
+  set_low_memory_mapping(false);
+
+  return __atomic_load_n(&cpus_online, __ATOMIC_SEQ_CST);
+}
+
+// Called by trampoline.asm on the stack of the application processor.
+extern "C" [[noreturn]] void ap_entry(uint32_t index)
+{
+  auto const &features = ap_setup_arch(index, boot_xcr0);
+
+  __atomic_add_fetch(&cpus_online, 1, __ATOMIC_SEQ_CST);
+
+  ap_start(features);
+  wait_forever();
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+struct cpu_features;
+
+// Where the xAPIC registers are mapped. See paging.cpp.
+constexpr uintptr_t local_apic_address = 0xFEE00000;
+
+// Setup an application processor like setup_arch() does for the boot CPU.
+cpu_features const &ap_setup_arch(size_t index, uint64_t xcr0);
@@ -1,6 +1,8 @@
   ; -*- Mode: nasm -*-
 
 %define PAGE_SIZE 4096
+%define LARGE_PAGE_SIZE (2 << 20)
+%define KERNEL_LARGE_PAGES 4    ; see kernel_mapping_size in paging.cpp
 %define IA32_EFER 0xC0000080
 %define IA32_EFER_LME 0x100
 %define IA32_EFER_NXE 0x800
@@ -23,7 +25,7 @@
 %define XCR0_SSE (1 << 1)
 %define XCR0_AVX (1 << 2)
 
-%define MAX_CMDLINE_SIZE 256
+%define MAX_CMDLINE_SIZE 4096
 
 bits 32
 
@@ -95,12 +97,17 @@ no_cmdline:
   or eax, PTE_P | PTE_W
   mov dword [boot_pdpt], eax
 
-  ; Fill out PDE
+  ; Fill out PDEs for the kernel image
   mov eax, _image_start
   mov ebx, eax
   shr ebx, 18
   or eax, PTE_P | PTE_W | PTE_PS
+  mov ecx, KERNEL_LARGE_PAGES
+.map_image:
   mov dword [boot_pd + ebx], eax
+  add eax, LARGE_PAGE_SIZE
+  add ebx, 8
+  loop .map_image
 
   ; Load page table
   mov eax, boot_pml4
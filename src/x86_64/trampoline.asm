@@ -0,0 +1,109 @@
+  ; -*- Mode: nasm -*-
+
+  ; Application processors start here in real mode. The code between
+  ; ap_trampoline_start and ap_trampoline_end is copied to TRAMPOLINE_BASE, so
+  ; it cannot refer to its own labels directly. See smp.cpp.
+
+%define TRAMPOLINE_BASE 0x8000  ; see trampoline_address in smp.cpp
+%define AP_STACK_SIZE 0x4000    ; see ap_stack_size in smp.cpp
+
+%define IA32_EFER 0xC0000080
+%define IA32_EFER_LME 0x100
+%define IA32_EFER_NXE 0x800
+
+%define CR0_PE (1 << 0)
+%define CR0_MP (1 << 1)
+%define CR0_WP (1 << 16)
+%define CR0_PG (1 << 31)
+
+  ; The selectors of the 64-bit segments match the boot GDT.
+%define TRAMPOLINE_CODE32_SELECTOR 0x08
+%define RING0_CODE_SELECTOR 0x10
+%define TRAMPOLINE_DATA32_SELECTOR 0x18
+%define RING0_DATA_SELECTOR 0x20
+
+  ; The address of a trampoline label after copying.
+%define REL(label) (TRAMPOLINE_BASE + (label) - ap_trampoline_start)
+
+extern ap_boot_cr3, ap_boot_cr4, ap_next_index, ap_index_limit, ap_stacks
+extern ap_entry
+global ap_trampoline_start, ap_trampoline_end
+
+section .text
+
+bits 16
+ap_trampoline_start:
+  cli
+  xor ax, ax
+  mov ds, ax
+
+  o32 lgdt [REL(trampoline_gdtr)]
+
+  mov eax, CR0_PE
+  mov cr0, eax
+  jmp dword TRAMPOLINE_CODE32_SELECTOR:REL(trampoline_32)
+
+bits 32
+trampoline_32:
+  mov eax, TRAMPOLINE_DATA32_SELECTOR
+  mov ds, eax
+  mov es, eax
+  mov ss, eax
+
+  ; Same as in start.asm, except that we use the values of the boot CPU.
+  mov eax, [ap_boot_cr4]
+  mov cr4, eax
+  mov eax, [ap_boot_cr3]
+  mov cr3, eax
+
+  xor edx, edx
+  mov eax, IA32_EFER_LME | IA32_EFER_NXE
+  mov ecx, IA32_EFER
+  wrmsr
+
+  mov eax, CR0_PE | CR0_MP | CR0_WP | CR0_PG
+  mov cr0, eax
+
+  jmp RING0_CODE_SELECTOR:ap_start_long
+
+align 8
+trampoline_gdt:
+  dq 0
+  dq 0x00cf9b000000ffff         ; 32-bit code
+  dq 0x00a09b0000000000         ; 64-bit code
+  dq 0x00cf93000000ffff         ; 32-bit data
+  dq 0x00a0930000000000         ; 64-bit data
+trampoline_gdt_end:
+
+trampoline_gdtr:
+  dw trampoline_gdt_end - trampoline_gdt - 1
+  dd REL(trampoline_gdt)
+ap_trampoline_end:
+
+bits 64
+ap_start_long:
+  mov eax, RING0_DATA_SELECTOR
+  mov ss, eax
+  mov ds, eax
+  mov es, eax
+  mov fs, eax
+  mov gs, eax
+  cld
+
+  mov eax, 1
+  lock xadd [ap_next_index], eax
+  cmp eax, [ap_index_limit]
+  jae .park
+
+  ; Each application processor uses the stack of its index.
+  mov edi, eax
+  inc rax
+  imul rax, AP_STACK_SIZE
+  lea rsp, [ap_stacks + rax]
+
+  call ap_entry
+
+.park:
+  cli
+  hlt
+  jmp .park